@@ -0,0 +1,91 @@
+#ifndef AUGMENTATION_H
+#define AUGMENTATION_H
+
+#include <type_traits>
+#include <utility>
+
+// Augmentation policies for persistent_set.
+//
+// Every node keeps the aggregate of the keys in its subtree. It is refreshed
+// whenever the tree links a node up, on the copy path and in place alike, so
+// any version answers range aggregates in O(log n). A policy is a class with
+//     type          - the aggregate
+//     identity()    - aggregate of no keys
+//     of(key)       - aggregate of a single key
+//     combine(a, b) - aggregate of the keys of a followed by the keys of b;
+//                     associative, but it need not be commutative
+// identity, of and combine must be noexcept, and the aggregate nothrow
+// movable: they run while nodes are being relinked, and a failed edit is
+// rolled back by moving saved aggregates into place, where an exception
+// could only leave a broken tree.
+// persistent_set checks this at compile time. Aggregates that need memory
+// should live in fixed storage, or the policy should treat allocation
+// failure as fatal.
+
+struct no_augmentation
+{
+    struct type {};
+
+    static type identity() noexcept {
+        return {};
+    }
+
+    template <typename K>
+    static type of(K const&) noexcept {
+        return {};
+    }
+
+    static type combine(type, type) noexcept {
+        return {};
+    }
+};
+
+// Sum of the keys, converted to V.
+template <typename V>
+struct sum_augmentation
+{
+    using type = V;
+
+    static type identity() noexcept(noexcept(V())) {
+        return V();
+    }
+
+    template <typename K>
+    static type of(K const& key) noexcept(noexcept(static_cast<V>(key))) {
+        return static_cast<V>(key);
+    }
+
+    static type combine(type const& a, type const& b) noexcept(noexcept(a + b)) {
+        return a + b;
+    }
+};
+
+// Where a node keeps its aggregate. An empty aggregate (no_augmentation)
+// becomes an empty base and costs the node nothing.
+template <typename A, bool = std::is_empty<typename A::type>::value>
+struct aggregate_slot
+{
+    typename A::type const& aggregate() const noexcept {
+        return value;
+    }
+
+    void set_aggregate(typename A::type v) noexcept {
+        value = std::move(v);
+    }
+
+private:
+
+    typename A::type value {A::identity()};
+};
+
+template <typename A>
+struct aggregate_slot<A, true> : A::type
+{
+    typename A::type const& aggregate() const noexcept {
+        return *this;
+    }
+
+    void set_aggregate(typename A::type const&) noexcept {}
+};
+
+#endif // AUGMENTATION_H
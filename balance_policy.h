@@ -0,0 +1,207 @@
+#ifndef BALANCE_POLICY_H
+#define BALANCE_POLICY_H
+
+#include <cstddef>
+#include <utility>
+#include "small_stack.h"
+
+// Balance policies for persistent_set.
+//
+// A policy never touches nodes directly, it works through the editor E handed
+// in by the tree:
+//     E::link                 - owning pointer to a node
+//     E::inline_depth         - path depth worth keeping on the stack
+//     E::size(p)              - number of keys in the subtree p
+//     ed.left(p), ed.right(p) - children of p
+//     ed.rebuild(src, l, r)   - node with the key of src and children l, r
+//
+// balance(ed, src, l, r) - node keyed by src over l and r, where l and r were
+//                          balanced before a single insertion or deletion
+// merge(ed, l, r)        - all keys of l < all keys of r, any sizes
+// join(ed, src, l, r)    - node keyed by src over l and r, all keys of l <
+//                          key of src < all keys of r, any sizes
+
+struct unbalanced
+{
+    template <typename E> using link = typename E::link;
+
+    template <typename E>
+    static link<E> balance(E& ed, link<E> src, link<E> l, link<E> r) {
+        return ed.rebuild(std::move(src), std::move(l), std::move(r));
+    }
+
+    // Lifts the minimum of r to the top. The left spine of r can be as long
+    // as the tree, so it is walked with an explicit stack.
+    template <typename E>
+    static link<E> merge(E& ed, link<E> l, link<E> r) {
+        if (!l) return r;
+        if (!r) return l;
+        small_stack<link<E>, E::inline_depth> spine;
+        link<E> next = ed.left(r);
+        while (next) {
+            spine.push(std::move(r));
+            r = std::move(next);
+            next = ed.left(r);
+        }
+        link<E> sub = ed.right(r);
+        while (!spine.empty()) {
+            link<E> cur = std::move(spine.top());
+            spine.pop();
+            link<E> cr = ed.right(cur);
+            sub = ed.rebuild(std::move(cur), std::move(sub), std::move(cr));
+        }
+        return ed.rebuild(std::move(r), std::move(l), std::move(sub));
+    }
+
+    template <typename E>
+    static link<E> join(E& ed, link<E> src, link<E> l, link<E> r) {
+        return ed.rebuild(std::move(src), std::move(l), std::move(r));
+    }
+};
+
+// Weight-balanced tree (Adams; parameters from Hirai & Yamamoto, delta = 3,
+// ratio = 2). Height is bounded by log_{4/3}(n), so sorted input no longer
+// degenerates into a list.
+struct weight_balanced
+{
+    template <typename E> using link = typename E::link;
+
+    template <typename E>
+    static link<E> balance(E& ed, link<E> src, link<E> l, link<E> r) {
+        std::size_t sl = E::size(l), sr = E::size(r);
+        if (sl + sr > 1) {
+            if (sr > delta * sl)
+                return rotate_left(ed, std::move(src), std::move(l), std::move(r));
+            if (sl > delta * sr)
+                return rotate_right(ed, std::move(src), std::move(l), std::move(r));
+        }
+        return ed.rebuild(std::move(src), std::move(l), std::move(r));
+    }
+
+    template <typename E>
+    static link<E> merge(E& ed, link<E> l, link<E> r) {
+        if (!l) return r;
+        if (!r) return l;
+        std::size_t sl = E::size(l), sr = E::size(r);
+        if (delta * sl < sr) {
+            link<E> rl = ed.left(r);
+            link<E> rr = ed.right(r);
+            rl = merge(ed, std::move(l), std::move(rl));
+            return balance(ed, std::move(r), std::move(rl), std::move(rr));
+        }
+        if (delta * sr < sl) {
+            link<E> ll = ed.left(l);
+            link<E> lr = ed.right(l);
+            lr = merge(ed, std::move(lr), std::move(r));
+            return balance(ed, std::move(l), std::move(ll), std::move(lr));
+        }
+        link<E> m;
+        if (sl > sr) {
+            l = extract_max(ed, std::move(l), m);
+        } else {
+            r = extract_min(ed, std::move(r), m);
+        }
+        return balance(ed, std::move(m), std::move(l), std::move(r));
+    }
+
+    // Descends the spine of the heavier side until the sizes are within
+    // delta of each other and balances on the way back (link in Data.Set).
+    template <typename E>
+    static link<E> join(E& ed, link<E> src, link<E> l, link<E> r) {
+        if (!l) return insert_min(ed, std::move(src), std::move(r));
+        if (!r) return insert_max(ed, std::move(src), std::move(l));
+        std::size_t sl = E::size(l), sr = E::size(r);
+        if (delta * sl < sr) {
+            link<E> rl = ed.left(r);
+            link<E> rr = ed.right(r);
+            rl = join(ed, std::move(src), std::move(l), std::move(rl));
+            return balance(ed, std::move(r), std::move(rl), std::move(rr));
+        }
+        if (delta * sr < sl) {
+            link<E> ll = ed.left(l);
+            link<E> lr = ed.right(l);
+            lr = join(ed, std::move(src), std::move(lr), std::move(r));
+            return balance(ed, std::move(l), std::move(ll), std::move(lr));
+        }
+        return ed.rebuild(std::move(src), std::move(l), std::move(r));
+    }
+
+private:
+
+    static constexpr std::size_t delta = 3;
+    static constexpr std::size_t ratio = 2;
+
+    template <typename E>
+    static link<E> rotate_left(E& ed, link<E> src, link<E> l, link<E> r) {
+        link<E> rl = ed.left(r);
+        link<E> rr = ed.right(r);
+        if (E::size(rl) < ratio * E::size(rr)) {
+            l = ed.rebuild(std::move(src), std::move(l), std::move(rl));
+            return ed.rebuild(std::move(r), std::move(l), std::move(rr));
+        }
+        link<E> rll = ed.left(rl);
+        link<E> rlr = ed.right(rl);
+        l = ed.rebuild(std::move(src), std::move(l), std::move(rll));
+        rr = ed.rebuild(std::move(r), std::move(rlr), std::move(rr));
+        return ed.rebuild(std::move(rl), std::move(l), std::move(rr));
+    }
+
+    template <typename E>
+    static link<E> rotate_right(E& ed, link<E> src, link<E> l, link<E> r) {
+        link<E> ll = ed.left(l);
+        link<E> lr = ed.right(l);
+        if (E::size(lr) < ratio * E::size(ll)) {
+            r = ed.rebuild(std::move(src), std::move(lr), std::move(r));
+            return ed.rebuild(std::move(l), std::move(ll), std::move(r));
+        }
+        link<E> lrl = ed.left(lr);
+        link<E> lrr = ed.right(lr);
+        r = ed.rebuild(std::move(src), std::move(lrr), std::move(r));
+        ll = ed.rebuild(std::move(l), std::move(ll), std::move(lrl));
+        return ed.rebuild(std::move(lr), std::move(ll), std::move(r));
+    }
+
+    template <typename E>
+    static link<E> insert_min(E& ed, link<E> src, link<E> cur) {
+        if (!cur) return ed.rebuild(std::move(src), nullptr, nullptr);
+        link<E> l = ed.left(cur);
+        link<E> r = ed.right(cur);
+        l = insert_min(ed, std::move(src), std::move(l));
+        return balance(ed, std::move(cur), std::move(l), std::move(r));
+    }
+
+    template <typename E>
+    static link<E> insert_max(E& ed, link<E> src, link<E> cur) {
+        if (!cur) return ed.rebuild(std::move(src), nullptr, nullptr);
+        link<E> l = ed.left(cur);
+        link<E> r = ed.right(cur);
+        r = insert_max(ed, std::move(src), std::move(r));
+        return balance(ed, std::move(cur), std::move(l), std::move(r));
+    }
+
+    template <typename E>
+    static link<E> extract_min(E& ed, link<E> cur, link<E>& m) {
+        link<E> l = ed.left(cur);
+        link<E> r = ed.right(cur);
+        if (!l) {
+            m = std::move(cur);
+            return r;
+        }
+        l = extract_min(ed, std::move(l), m);
+        return balance(ed, std::move(cur), std::move(l), std::move(r));
+    }
+
+    template <typename E>
+    static link<E> extract_max(E& ed, link<E> cur, link<E>& m) {
+        link<E> l = ed.left(cur);
+        link<E> r = ed.right(cur);
+        if (!r) {
+            m = std::move(cur);
+            return l;
+        }
+        r = extract_max(ed, std::move(r), m);
+        return balance(ed, std::move(cur), std::move(l), std::move(r));
+    }
+};
+
+#endif // BALANCE_POLICY_H
@@ -0,0 +1,396 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "persistent_btree_set.h"
+#include "persistent_hash_set.h"
+#include "persistent_set.h"
+#include "persistent_set_snapshot.h"
+#include "smart_linked_pointer.h"
+#include "smart_intrusive_pointer.h"
+
+template <typename T>
+using shared_set = persistent_set<T, smart_shared_pointer>;
+
+template <typename T>
+using linked_set = persistent_set<T, smart_linked_pointer>;
+
+template <typename T>
+using std_shared_set = persistent_set<T, std::shared_ptr>;
+
+template <typename T>
+using intrusive_set = persistent_set<T, smart_intrusive_pointer>;
+
+template <typename T>
+using unbalanced_set = persistent_set<T, smart_shared_pointer, unbalanced>;
+
+template <typename T>
+using btree_set = persistent_btree_set<T>;
+
+template <typename T>
+using hash_set = persistent_hash_set<T>;
+
+// Heap allocations of the whole process: nodes, key boxes and string
+// buffers alike.
+static std::size_t heap_allocations = 0;
+
+// Out of line, so that the compiler does not see free() paired with new.
+static void release(void* p) noexcept __attribute__((noinline));
+
+static void release(void* p) noexcept {
+    std::free(p);
+}
+
+void* operator new(std::size_t size) {
+    ++heap_allocations;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    release(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    release(p);
+}
+
+// Reports the heap allocations made since before per processed key.
+static void count_allocations(benchmark::State& state, std::size_t before) {
+    state.counters["allocs/key"] = benchmark::Counter(
+        static_cast<double>(heap_allocations - before) / static_cast<double>(state.iterations() * state.range(0)));
+}
+
+// A string key that opts into shared key boxes (see key_storage.h).
+struct boxed_string : std::string {
+    boxed_string() = default;
+
+    boxed_string(std::string s) : std::string(std::move(s)) {}
+};
+
+template <>
+struct shares_key<boxed_string> : std::true_type {};
+
+// The recursive path-copying insert persistent_set had before its edits
+// became iterative, over the same node pointers, for the unbalanced
+// benchmarks below. It also records the deepest stack address it reaches.
+template <typename T>
+struct recursive_set {
+    struct node {
+        T key;
+        smart_shared_pointer<node> left;
+        smart_shared_pointer<node> right;
+    };
+
+    using link = smart_shared_pointer<node>;
+
+    static std::uintptr_t stack_low;
+
+    void insert(T const& k) {
+        root = put(root, k);
+    }
+
+private:
+
+    static link put(link const& t, T const& k) {
+        char here;
+        stack_low = std::min(stack_low, reinterpret_cast<std::uintptr_t>(&here));
+        if (!t) return link(new node{k, nullptr, nullptr});
+        if (k < t->key) return link(new node{t->key, put(t->left, k), t->right});
+        if (t->key < k) return link(new node{t->key, t->left, put(t->right, k)});
+        return t;
+    }
+
+    link root;
+};
+
+template <typename T>
+std::uintptr_t recursive_set<T>::stack_low = UINTPTR_MAX;
+
+template <typename T>
+struct keys;
+
+template <>
+struct keys<int> {
+    static std::vector<int> random(std::size_t n) {
+        std::mt19937 gen(4418);
+        std::vector<int> v(n);
+        for (auto& x : v) x = static_cast<int>(gen());
+        return v;
+    }
+};
+
+template <>
+struct keys<std::string> {
+    static std::vector<std::string> random(std::size_t n) {
+        std::mt19937 gen(4418);
+        std::vector<std::string> v(n);
+        for (auto& x : v) {
+            x.resize(24);
+            for (auto& c : x) c = static_cast<char>('a' + gen() % 26);
+        }
+        return v;
+    }
+};
+
+template <>
+struct keys<boxed_string> {
+    static std::vector<boxed_string> random(std::size_t n) {
+        std::vector<std::string> v = keys<std::string>::random(n);
+        return std::vector<boxed_string>(v.begin(), v.end());
+    }
+};
+
+template <typename T>
+static std::vector<T> sorted_keys(std::size_t n) {
+    std::vector<T> v = keys<T>::random(n);
+    std::sort(v.begin(), v.end());
+    v.erase(std::unique(v.begin(), v.end()), v.end());
+    return v;
+}
+
+template <typename Set, typename T>
+static Set build(std::vector<T> const& v) {
+    Set st;
+    for (auto const& x : v) st.insert(x);
+    return st;
+}
+
+template <typename Set, typename T>
+static void insert_random(benchmark::State& state) {
+    std::vector<T> v = keys<T>::random(static_cast<std::size_t>(state.range(0)));
+    std::size_t before = heap_allocations;
+    for (auto _ : state) {
+        Set st = build<Set>(v);
+        benchmark::DoNotOptimize(st);
+    }
+    count_allocations(state, before);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Every version stays alive, so every insert copies its whole path.
+template <typename Set, typename T>
+static void insert_versions(benchmark::State& state) {
+    std::vector<T> v = keys<T>::random(static_cast<std::size_t>(state.range(0)));
+    std::size_t before = heap_allocations;
+    for (auto _ : state) {
+        std::vector<Set> versions(1);
+        versions.reserve(v.size() + 1);
+        for (auto const& x : v) {
+            Set next = versions.back();
+            next.insert(x);
+            versions.push_back(std::move(next));
+        }
+        benchmark::DoNotOptimize(versions);
+    }
+    count_allocations(state, before);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template <typename Set, typename T>
+static void insert_sorted(benchmark::State& state) {
+    std::vector<T> v = sorted_keys<T>(static_cast<std::size_t>(state.range(0)));
+    for (auto _ : state) {
+        Set st = build<Set>(v);
+        benchmark::DoNotOptimize(st);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template <typename Set, typename T>
+static void insert_transient(benchmark::State& state) {
+    std::vector<T> v = keys<T>::random(static_cast<std::size_t>(state.range(0)));
+    for (auto _ : state) {
+        typename Set::transient_set tr;
+        for (auto const& x : v) tr.insert(x);
+        Set st = tr.persistent();
+        benchmark::DoNotOptimize(st);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template <typename Set, typename T>
+static void build_sorted(benchmark::State& state) {
+    std::vector<T> v = sorted_keys<T>(static_cast<std::size_t>(state.range(0)));
+    for (auto _ : state) {
+        Set st(v.begin(), v.end());
+        benchmark::DoNotOptimize(st);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Mapping a saved set and promoting it to heap nodes; compare with
+// insert_random, which rebuilds the same set key by key.
+template <typename Set, typename T>
+static void restore_snapshot(benchmark::State& state) {
+    std::string path = "persistent_set_bench.snap";
+    save_snapshot(build<Set>(keys<T>::random(static_cast<std::size_t>(state.range(0)))), path);
+    for (auto _ : state) {
+        snapshot_set<Set> loaded(path);
+        Set st = loaded.persistent();
+        benchmark::DoNotOptimize(st);
+    }
+    std::remove(path.c_str());
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template <typename Set, typename T>
+static void find_random(benchmark::State& state) {
+    std::vector<T> v = keys<T>::random(static_cast<std::size_t>(state.range(0)));
+    Set st = build<Set>(v);
+    std::shuffle(v.begin(), v.end(), std::mt19937(5551));
+    for (auto _ : state) {
+        for (auto const& x : v) benchmark::DoNotOptimize(st.find(x));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Short in-order scans from random starting keys.
+template <typename Set, typename T>
+static void scan_range(benchmark::State& state) {
+    std::vector<T> v = keys<T>::random(static_cast<std::size_t>(state.range(0)));
+    Set st = build<Set>(v);
+    std::shuffle(v.begin(), v.end(), std::mt19937(5551));
+    std::size_t next = 0;
+    for (auto _ : state) {
+        auto it = st.lower_bound(v[next++ % v.size()]);
+        for (int n = 0; n < 64 && it != st.end(); ++n, ++it) benchmark::DoNotOptimize(*it);
+    }
+    state.SetItemsProcessed(state.iterations() * 64);
+}
+
+template <typename Set, typename T>
+static void erase_random(benchmark::State& state) {
+    std::vector<T> v = keys<T>::random(static_cast<std::size_t>(state.range(0)));
+    Set full = build<Set>(v);
+    std::shuffle(v.begin(), v.end(), std::mt19937(5551));
+    for (auto _ : state) {
+        state.PauseTiming();
+        Set st = full;
+        state.ResumeTiming();
+        for (auto const& x : v) st.erase(x);
+        benchmark::DoNotOptimize(st);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template <typename Set, typename T>
+static void iterate_forward(benchmark::State& state) {
+    Set st = build<Set>(keys<T>::random(static_cast<std::size_t>(state.range(0))));
+    for (auto _ : state) {
+        for (auto const& x : st) benchmark::DoNotOptimize(x);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// In-order walk over borrowed pointers; compare with iterate_forward.
+template <typename Set, typename T>
+static void iterate_borrowed(benchmark::State& state) {
+    Set st = build<Set>(keys<T>::random(static_cast<std::size_t>(state.range(0))));
+    for (auto _ : state) {
+        st.for_each([](T const& x) { benchmark::DoNotOptimize(x); });
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template <typename Set, typename T>
+static void iterate_backward(benchmark::State& state) {
+    Set st = build<Set>(keys<T>::random(static_cast<std::size_t>(state.range(0))));
+    for (auto _ : state) {
+        auto first = st.begin();
+        auto it = st.end();
+        while (it != first) benchmark::DoNotOptimize(*--it);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Stack the recursive insert needs per level of a degenerate tree, and the
+// depth that fits in the usual 8 MiB main thread stack. The iterative
+// edits keep their path on the heap past a fixed inline buffer, so their
+// depth is bounded by memory only.
+static void recursive_stack_depth(benchmark::State& state) {
+    std::vector<int> v = sorted_keys<int>(static_cast<std::size_t>(state.range(0)));
+    double per_level = 0;
+    for (auto _ : state) {
+        char top;
+        recursive_set<int>::stack_low = UINTPTR_MAX;
+        recursive_set<int> st = build<recursive_set<int>>(v);
+        benchmark::DoNotOptimize(st);
+        per_level = static_cast<double>(reinterpret_cast<std::uintptr_t>(&top) - recursive_set<int>::stack_low)
+                  / static_cast<double>(v.size());
+    }
+    state.counters["stack B/level"] = per_level;
+    state.counters["max depth"] = 8.0 * 1024 * 1024 / per_level;
+}
+
+#define SET_BENCHMARKS(bench, T, lo, hi)                                  \
+    BENCHMARK_TEMPLATE(bench, std::set<T>, T)->Range(lo, hi);            \
+    BENCHMARK_TEMPLATE(bench, shared_set<T>, T)->Range(lo, hi);          \
+    BENCHMARK_TEMPLATE(bench, linked_set<T>, T)->Range(lo, hi);          \
+    BENCHMARK_TEMPLATE(bench, std_shared_set<T>, T)->Range(lo, hi);      \
+    BENCHMARK_TEMPLATE(bench, intrusive_set<T>, T)->Range(lo, hi)
+
+SET_BENCHMARKS(insert_random, int, 1 << 10, 1 << 16);
+SET_BENCHMARKS(insert_sorted, int, 1 << 10, 1 << 16);
+SET_BENCHMARKS(build_sorted, int, 1 << 10, 1 << 16);
+SET_BENCHMARKS(find_random, int, 1 << 10, 1 << 16);
+SET_BENCHMARKS(scan_range, int, 1 << 10, 1 << 16);
+SET_BENCHMARKS(erase_random, int, 1 << 10, 1 << 16);
+SET_BENCHMARKS(iterate_forward, int, 1 << 10, 1 << 16);
+SET_BENCHMARKS(iterate_backward, int, 1 << 10, 1 << 16);
+
+SET_BENCHMARKS(insert_random, std::string, 1 << 10, 1 << 16);
+SET_BENCHMARKS(find_random, std::string, 1 << 10, 1 << 16);
+SET_BENCHMARKS(erase_random, std::string, 1 << 10, 1 << 16);
+SET_BENCHMARKS(iterate_forward, std::string, 1 << 10, 1 << 16);
+
+// Strings kept in the node (the default) against strings in shared boxes.
+BENCHMARK_TEMPLATE(insert_random, shared_set<boxed_string>, boxed_string)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(find_random, shared_set<boxed_string>, boxed_string)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(insert_versions, shared_set<std::string>, std::string)->Range(1 << 10, 1 << 14);
+BENCHMARK_TEMPLATE(insert_versions, shared_set<boxed_string>, boxed_string)->Range(1 << 10, 1 << 14);
+
+BENCHMARK_TEMPLATE(restore_snapshot, shared_set<int>, int)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(restore_snapshot, intrusive_set<int>, int)->Range(1 << 10, 1 << 16);
+
+// Transients have no std::set counterpart; compare with insert_random.
+BENCHMARK_TEMPLATE(insert_transient, shared_set<int>, int)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(insert_transient, intrusive_set<int>, int)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(insert_transient, intrusive_set<std::string>, std::string)->Range(1 << 10, 1 << 16);
+
+BENCHMARK_TEMPLATE(iterate_borrowed, shared_set<int>, int)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(iterate_borrowed, linked_set<int>, int)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(iterate_borrowed, intrusive_set<std::string>, std::string)->Range(1 << 10, 1 << 16);
+
+// Wide nodes against the binary tree on the same workloads.
+BENCHMARK_TEMPLATE(insert_random, btree_set<int>, int)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(insert_sorted, btree_set<int>, int)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(find_random, btree_set<int>, int)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(scan_range, btree_set<int>, int)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(erase_random, btree_set<int>, int)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(iterate_forward, btree_set<int>, int)->Range(1 << 10, 1 << 16);
+
+// Membership only: the hash trie against the ordered engines.
+BENCHMARK_TEMPLATE(insert_random, hash_set<int>, int)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(find_random, hash_set<int>, int)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(erase_random, hash_set<int>, int)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(iterate_forward, hash_set<int>, int)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(insert_random, hash_set<std::string>, std::string)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(find_random, hash_set<std::string>, std::string)->Range(1 << 10, 1 << 16);
+
+// The plain BST degenerates into a list on sorted input; the iterative
+// edits against the recursive ones.
+BENCHMARK_TEMPLATE(insert_sorted, unbalanced_set<int>, int)->Range(1 << 8, 1 << 12);
+BENCHMARK_TEMPLATE(insert_sorted, recursive_set<int>, int)->Range(1 << 8, 1 << 12);
+BENCHMARK_TEMPLATE(insert_random, unbalanced_set<int>, int)->Range(1 << 8, 1 << 12);
+BENCHMARK_TEMPLATE(insert_random, recursive_set<int>, int)->Range(1 << 8, 1 << 12);
+BENCHMARK(recursive_stack_depth)->Arg(1 << 12);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,266 @@
+#ifndef CONCURRENT_PERSISTENT_SET_H
+#define CONCURRENT_PERSISTENT_SET_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "persistent_set.h"
+#include "smart_atomic_pointer.h"
+
+// Hazard pointers guarding the published versions of concurrent sets.
+// A reader announces the version it is about to copy in a slot of its
+// thread; a retired version is destroyed only once no slot announces it.
+// Each thread keeps a stack of slots, one per guard alive on it, so a call
+// that protects one version may protect others while it runs - a query on
+// one set may read or edit another, or the same one.
+//
+// The slots come from a fixed table: at most max_threads threads may use
+// concurrent sets at once, each nesting guards at most max_nesting deep.
+// A thread keeps the slots it took until it exits. Going past either limit
+// throws std::runtime_error.
+struct hazard_domain
+{
+    static constexpr std::size_t max_threads = 128;
+    static constexpr std::size_t max_nesting = 4;
+
+    // Takes the next slot of this thread for as long as it lives; guards
+    // must end in the reverse order they began, as scopes do.
+    struct guard {
+        std::atomic<void const*>& hp;
+
+        guard() : hp(push()) {}
+
+        guard(guard const&) = delete;
+        guard& operator=(guard const&) = delete;
+
+        ~guard() {
+            hp.store(nullptr, std::memory_order_release);
+            --local().depth;
+        }
+    };
+
+    static void retire(void const* p, void (*destroy)(void const*)) {
+        thread_record& rec = local();
+        rec.retired.push_back({p, destroy});
+        if (rec.retired.size() >= scan_threshold) scan(rec.retired);
+    }
+
+private:
+
+    static constexpr std::size_t max_slots = max_threads * max_nesting;
+    static constexpr std::size_t scan_threshold = 8;
+
+    struct alignas(64) hazard {
+        std::atomic<void const*> ptr {nullptr};
+        std::atomic<bool> taken {false};
+    };
+
+    struct retired_ptr {
+        void const* p;
+        void (*destroy)(void const*);
+    };
+
+    struct thread_record {
+        hazard* own[max_nesting] {};
+        std::size_t depth {0};
+        std::vector<retired_ptr> retired;
+
+        ~thread_record() {
+            for (hazard* h : own) {
+                if (!h) break;
+                h->ptr.store(nullptr);
+                h->taken.store(false, std::memory_order_release);
+            }
+            scan(retired);
+            if (retired.empty()) return;
+            std::lock_guard<std::mutex> lock(orphans_mutex());
+            orphans().insert(orphans().end(), retired.begin(), retired.end());
+        }
+    };
+
+    static hazard* table() {
+        static hazard slots[max_slots];
+        return slots;
+    }
+
+    static std::atomic<void const*>& push() {
+        thread_record& rec = local();
+        if (rec.depth == max_nesting) throw std::runtime_error("hazard_domain: guards nested too deeply");
+        hazard*& h = rec.own[rec.depth];
+        if (!h) h = claim();
+        ++rec.depth;
+        return h->ptr;
+    }
+
+    static thread_record& local() {
+        static thread_local thread_record rec;
+        return rec;
+    }
+
+    static std::mutex& orphans_mutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    // Versions retired by threads that exited while they were still in use.
+    static std::vector<retired_ptr>& orphans() {
+        static std::vector<retired_ptr> v;
+        return v;
+    }
+
+    static hazard* claim() {
+        for (std::size_t i = 0; i < max_slots; ++i) {
+            bool expected = false;
+            if (table()[i].taken.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                return &table()[i];
+        }
+        throw std::runtime_error("hazard_domain: too many threads");
+    }
+
+    static void scan(std::vector<retired_ptr>& list) {
+        {
+            std::lock_guard<std::mutex> lock(orphans_mutex());
+            list.insert(list.end(), orphans().begin(), orphans().end());
+            orphans().clear();
+        }
+
+        std::vector<void const*> protect;
+        for (std::size_t i = 0; i < max_slots; ++i) {
+            if (void const* p = table()[i].ptr.load()) protect.push_back(p);
+        }
+        std::sort(protect.begin(), protect.end());
+
+        std::vector<retired_ptr> keep;
+        for (retired_ptr const& r : list) {
+            if (std::binary_search(protect.begin(), protect.end(), r.p))
+                keep.push_back(r);
+            else
+                r.destroy(r.p);
+        }
+        list.swap(keep);
+    }
+};
+
+// The current version of a persistent_set in an atomic slot. Readers take
+// immutable snapshots without locking; writers copy the current version,
+// edit the copy and publish it with compare-and-swap, retrying if another
+// writer got there first. Versions share nodes across threads, so the
+// pointer policy must be thread safe.
+template <typename T, template<typename> class scoped_ptr = smart_atomic_pointer,
+          typename balancer = weight_balanced, typename allocator = default_node_allocator>
+struct concurrent_persistent_set
+{
+    using value_type = T;
+    using set_type = persistent_set<T, scoped_ptr, balancer, allocator>;
+
+    static_assert(pointer_traits<scoped_ptr>::thread_safe,
+                  "concurrent_persistent_set needs a thread-safe pointer policy");
+
+    concurrent_persistent_set() : current(new set_type()) {}
+
+    explicit concurrent_persistent_set(set_type initial)
+        : current(new set_type(std::move(initial))) {}
+
+    concurrent_persistent_set(concurrent_persistent_set const&) = delete;
+    concurrent_persistent_set& operator=(concurrent_persistent_set const&) = delete;
+
+    // No other thread may use the set while it is destroyed.
+    ~concurrent_persistent_set() {
+        delete current.load();
+    }
+
+    // Runs query(set_type const&) on the current version in place, without
+    // copying it: the version stays announced in a hazard slot of this
+    // thread for the call. Queries that walk borrowed pointers (contains,
+    // size, rank, aggregate, for_each, borrow) then write nothing but that
+    // slot, so readers on different cores do not fight over reference
+    // counts of the upper nodes. query must not keep references into the set past
+    // the call; it may use this or other concurrent sets, up to
+    // hazard_domain::max_nesting calls deep.
+    template <typename F>
+    auto read(F query) const -> decltype(query(std::declval<set_type const&>())) {
+        hazard_domain::guard g;
+        return query(*protect(g.hp));
+    }
+
+    bool contains(value_type const& value) const {
+        return read([&value](set_type const& s) {
+            return s.contains(value);
+        });
+    }
+
+    std::size_t size() const {
+        return read([](set_type const& s) {
+            return s.size();
+        });
+    }
+
+    set_type snapshot() const {
+        hazard_domain::guard g;
+        return set_type(*protect(g.hp));
+    }
+
+    void store(set_type s) {
+        set_type const* old = current.exchange(new set_type(std::move(s)));
+        hazard_domain::retire(old, &destroy);
+    }
+
+    // Applies edit(set_type&) to a copy of the current version and publishes
+    // the copy. edit may run several times and returns false to leave the
+    // current version in place. Returns whether a version was published.
+    template <typename F>
+    bool update(F edit) {
+        hazard_domain::guard g;
+        for (;;) {
+            set_type const* old = protect(g.hp);
+            set_type edited(*old);
+            if (!edit(edited)) return false;
+            // old stays announced until the exchange, so its address cannot
+            // be reused by a newer version in the meantime.
+            set_type* next = new set_type(std::move(edited));
+            set_type const* expected = old;
+            if (current.compare_exchange_weak(expected, next)) {
+                g.hp.store(nullptr, std::memory_order_release);
+                hazard_domain::retire(old, &destroy);
+                return true;
+            }
+            delete next;
+        }
+    }
+
+    bool insert(value_type const& value) {
+        return update([&value](set_type& s) {
+            return s.insert(value).second;
+        });
+    }
+
+    bool erase(value_type const& value) {
+        return update([&value](set_type& s) {
+            return s.erase(value) != 0;
+        });
+    }
+
+private:
+
+    std::atomic<set_type const*> current;
+
+    set_type const* protect(std::atomic<void const*>& hp) const {
+        set_type const* p = current.load();
+        for (;;) {
+            hp.store(p);
+            set_type const* q = current.load();
+            if (p == q) return p;
+            p = q;
+        }
+    }
+
+    static void destroy(void const* p) {
+        delete static_cast<set_type const*>(p);
+    }
+};
+
+#endif // CONCURRENT_PERSISTENT_SET_H
@@ -0,0 +1,76 @@
+#ifndef KEY_STORAGE_H
+#define KEY_STORAGE_H
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include "pointer_traits.h"
+
+// Where a persistent_set node keeps its key.
+//
+// A path copy makes a new node for every level it passes, and each of them
+// needs the key of the node it replaces. By default the key is copied into
+// the node: lookups read it without another load and a fresh insert makes
+// one allocation. Keys larger than a cache line are instead made once, in a
+// refcounted box that is never changed afterwards; copied nodes share the
+// box, so a path copy moves child pointers and counts, never key bytes.
+//
+// Specialize shares_key for a type to override the choice, e.g. for strings
+// in sets whose old versions are kept and edited a lot: boxing makes path
+// copies cheaper but costs lookups a dependent load and each new key an
+// extra allocation.
+template <typename T>
+struct shares_key : std::integral_constant<bool, (sizeof(T) > 64)> {};
+
+template <typename T, template<typename> class scoped_ptr, typename allocator,
+          bool = shares_key<T>::value>
+struct key_storage
+{
+    explicit key_storage(T const& key) : key(key) {}
+
+    explicit key_storage(T&& key) : key(std::move(key)) {}
+
+    T const& get() const noexcept {
+        return key;
+    }
+
+private:
+
+    T key;
+};
+
+template <typename T, template<typename> class scoped_ptr, typename allocator>
+struct key_storage<T, scoped_ptr, allocator, true>
+{
+    explicit key_storage(T const& key) : box(new key_box(key)) {}
+
+    explicit key_storage(T&& key) : box(new key_box(std::move(key))) {}
+
+    T const& get() const noexcept {
+        return box->key;
+    }
+
+private:
+
+    // Allocated through the node allocator and owned through the node
+    // pointer policy, so it is as thread safe as the nodes sharing it.
+    struct key_box : pointer_traits<scoped_ptr>::node_base {
+        T const key;
+
+        explicit key_box(T const& key) : key(key) {}
+
+        explicit key_box(T&& key) : key(std::move(key)) {}
+
+        static void* operator new(std::size_t size) {
+            return allocator::allocate(size);
+        }
+
+        static void operator delete(void* p, std::size_t size) noexcept {
+            allocator::deallocate(p, size);
+        }
+    };
+
+    scoped_ptr<key_box> box;
+};
+
+#endif // KEY_STORAGE_H
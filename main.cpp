@@ -1,8 +1,23 @@
 #include <iostream>
 #include "persistent_set.h"
 #include "smart_linked_pointer.h"
+#include "smart_intrusive_pointer.h"
+#include "smart_atomic_pointer.h"
+#include "concurrent_persistent_set.h"
+#include "persistent_btree_set.h"
+#include "persistent_hash_set.h"
+#include "persistent_set_snapshot.h"
 #include <algorithm>
+#include <functional>
+#include <limits>
+#include <map>
+#include <mutex>
 #include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_set>
+#include <thread>
 #include "gtest/gtest.h"
 #include <gmock/gmock.h>
 
@@ -828,6 +843,1951 @@ TEST(SmartLinkedPtr_CornerCases, self_assignment) {
     EXPECT_TRUE(*(st.begin()) == 1);
 }
 
+TEST(SharedPtr_Balance, sorted_insert_erase_ints) {
+    persistent_set<int> st;
+    for (int i = 0; i < 200000; ++i) st.insert(i);
+    persistent_set<int> sst(st);
+    for (int i = 0; i < 200000; i += 2) st.erase(st.find(i));
+
+    int expected = 1;
+    for (int x : st) {
+        ASSERT_EQ(x, expected);
+        expected += 2;
+    }
+    EXPECT_EQ(expected, 200001);
+    EXPECT_TRUE(sst.find(0) != sst.end());
+    EXPECT_TRUE(st.find(0) == st.end());
+}
+
+TEST(SmartLinkedPtr_Balance, descending_insert_ints) {
+    persistent_set<int, smart_linked_pointer> st;
+    for (int i = 50000; i > 0; --i) st.insert(i);
+    int expected = 1;
+    for (int x : st) ASSERT_EQ(x, expected++);
+    EXPECT_EQ(expected, 50001);
+}
+
+TEST(Unbalanced_RandomTests, insert_erase_ints) {
+    srand((unsigned)time(nullptr));
+    persistent_set<int, smart_shared_pointer, unbalanced> st;
+    std::set<int> rst;
+    for (int i = 0; i < 3000; ++i) {
+        int x = rand() % 2000 - 1000;
+        if (i % 3 == 2 && st.find(x) != st.end()) {
+            st.erase(st.find(x));
+            rst.erase(x);
+        } else {
+            st.insert(x);
+            rst.insert(x);
+        }
+    }
+    std::vector<int> c, cc;
+    for (int x : st) c.push_back(x);
+    for (int x : rst) cc.push_back(x);
+    EXPECT_EQ(c, cc);
+}
+
+TEST(IntrusivePtr_RandomTests, insert_find_erase_ints) {
+    srand((unsigned)time(nullptr));
+    persistent_set<int, smart_intrusive_pointer> st;
+    persistent_set<int, smart_intrusive_pointer> sst;
+    std::set<int> cst, csst;
+    for (int i = 0; i < 5000; ++i) {
+        int x = rand() % 1000;
+        switch (rand() % 6) {
+        case 0:
+            cst.insert(x);
+            st.insert(x);
+            break;
+        case 1:
+            csst.insert(x);
+            sst.insert(x);
+            break;
+        case 2:
+            if (st.find(x) != st.end()) {
+                st.erase(st.find(x));
+                cst.erase(x);
+            }
+            break;
+        case 3:
+            if (sst.begin() != sst.end()) {
+                sst.erase(sst.begin());
+                csst.erase(csst.begin());
+            }
+            break;
+        case 4:
+            st = sst;
+            cst = csst;
+            break;
+        default:
+            sst = st;
+            csst = cst;
+            break;
+        }
+    }
+    std::vector<int> vst, vsst, vcst, vcsst;
+    for (int x : st) vst.push_back(x);
+    for (int x : sst) vsst.push_back(x);
+    for (int x : cst) vcst.push_back(x);
+    for (int x : csst) vcsst.push_back(x);
+    EXPECT_EQ(vst, vcst);
+    EXPECT_EQ(vsst, vcsst);
+}
+
+TEST(IntrusivePtr_RandomTests, copy_constructor_strings) {
+    srand(4418);
+    persistent_set<std::string, smart_intrusive_pointer> st;
+    for (int i = 0; i < 1000; ++i) st.insert(get_word());
+    persistent_set<std::string, smart_intrusive_pointer> st2(st);
+    std::string x = get_word() + "!";
+    st2.insert(x);
+    EXPECT_TRUE(st.find(x) == st.end());
+    EXPECT_TRUE(st2.find(x) != st2.end());
+    st2.erase(st2.find(x));
+    for (auto const& y : st) {
+        EXPECT_TRUE(st2.find(y) != st2.end());
+    }
+}
+
+TEST(PoolAllocator, recycles_nodes) {
+    using pooled_set = persistent_set<int, smart_shared_pointer, weight_balanced, pool_node_allocator>;
+    pool_node_allocator::statistics before = pool_node_allocator::stats();
+    {
+        pooled_set st;
+        for (int i = 0; i < 1000; ++i) st.insert(i);
+        pooled_set sst(st);
+        for (int i = 0; i < 1000; i += 2) sst.erase(sst.find(i));
+        int expected = 0;
+        for (int x : st) ASSERT_EQ(x, expected++);
+        expected = 1;
+        for (int x : sst) {
+            ASSERT_EQ(x, expected);
+            expected += 2;
+        }
+    }
+    pool_node_allocator::statistics after = pool_node_allocator::stats();
+    EXPECT_GT(after.allocations, before.allocations);
+    EXPECT_EQ(after.in_use(), before.in_use());
+
+    std::size_t slabs = after.slabs;
+    {
+        pooled_set st;
+        for (int i = 0; i < 1000; ++i) st.insert(i);
+    }
+    EXPECT_EQ(pool_node_allocator::stats().slabs, slabs);
+}
+
+TEST(PoolAllocator, strings_across_threads) {
+    using pooled_set = persistent_set<std::string, smart_intrusive_pointer, weight_balanced, pool_node_allocator>;
+    pooled_set st;
+    std::thread worker([&st] {
+        for (int i = 0; i < 1000; ++i) st.insert(std::to_string(i));
+    });
+    worker.join();
+    pooled_set sst(st);
+    for (int i = 0; i < 1000; i += 3) sst.erase(sst.find(std::to_string(i)));
+    st = pooled_set();
+    std::set<std::string> rst;
+    for (int i = 0; i < 1000; ++i) if (i % 3) rst.insert(std::to_string(i));
+    std::vector<std::string> c, cc;
+    for (auto const& x : sst) c.push_back(x);
+    for (auto const& x : rst) cc.push_back(x);
+    EXPECT_EQ(c, cc);
+}
+
+TEST(PoolAllocator, frees_from_another_thread_are_reused) {
+    using pooled_set = persistent_set<int, smart_intrusive_pointer, weight_balanced, pool_node_allocator>;
+    std::size_t in_use = pool_node_allocator::stats().in_use();
+    std::mutex m;
+    pooled_set handoff;
+    bool ready = false;
+    int const rounds = 60;
+    // Hands a set built by the producer to the consumer, one at a time.
+    auto exchange = [&](bool filled, pooled_set& st) {
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                if (ready != filled) {
+                    std::swap(st, handoff);
+                    ready = filled;
+                    return;
+                }
+            }
+            std::this_thread::yield();
+        }
+    };
+    std::thread producer([&] {
+        for (int round = 0; round < rounds; ++round) {
+            pooled_set st;
+            for (int i = 0; i < 2000; ++i) st.insert(i);
+            exchange(true, st);
+        }
+    });
+    std::size_t warm_slabs = 0;
+    for (int round = 0; round < rounds; ++round) {
+        pooled_set st;
+        exchange(false, st);
+        EXPECT_EQ(st.size(), 2000u);
+        st = pooled_set();
+        if (round == 10) warm_slabs = pool_node_allocator::stats().slabs;
+    }
+    producer.join();
+    // The consumer hands freed blocks back through the depot; without that
+    // every round would cost the producer another 2000 blocks of slabs.
+    EXPECT_LE(pool_node_allocator::stats().slabs, warm_slabs + 4);
+    EXPECT_EQ(pool_node_allocator::stats().in_use(), in_use);
+}
+
+TEST(AtomicPtr_Threads, shared_snapshots_stress) {
+    persistent_set<int, smart_atomic_pointer> base;
+    std::vector<int> expected;
+    for (int i = 0; i < 2000; ++i) {
+        base.insert(i * 2);
+        expected.push_back(i * 2);
+    }
+    persistent_set<int, smart_atomic_pointer> const& shared = base;
+
+    std::vector<std::thread> readers;
+    std::vector<int> failures(8);
+    for (int t = 0; t < 8; ++t) {
+        readers.emplace_back([&shared, &expected, &failures, t] {
+            for (int round = 0; round < 50; ++round) {
+                persistent_set<int, smart_atomic_pointer> mine(shared);
+                mine.insert(round * 2 + 1);
+                mine.erase(mine.find(t * 2));
+                if (shared.find(round * 2 + 1) != shared.end()) ++failures[t];
+                if (shared.find(t * 2) == shared.end()) ++failures[t];
+                std::size_t i = 0;
+                for (int x : shared) {
+                    if (i >= expected.size() || x != expected[i]) ++failures[t];
+                    ++i;
+                }
+            }
+        });
+    }
+    for (auto& r : readers) r.join();
+
+    for (int t = 0; t < 8; ++t) EXPECT_EQ(failures[t], 0);
+    std::vector<int> c;
+    for (int x : base) c.push_back(x);
+    EXPECT_EQ(c, expected);
+}
+
+TEST(ConcurrentSet, writers_and_readers) {
+    concurrent_persistent_set<int> cst;
+    std::atomic<bool> done {false};
+    std::vector<std::thread> threads;
+    std::vector<int> failures(4);
+
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&cst, t] {
+            for (int i = 0; i < 300; ++i) EXPECT_TRUE(cst.insert(t * 1000 + i));
+            for (int i = 0; i < 300; i += 3) EXPECT_TRUE(cst.erase(t * 1000 + i));
+        });
+    }
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&cst, &done, &failures, t] {
+            while (!done) {
+                persistent_set<int, smart_atomic_pointer> snap = cst.snapshot();
+                std::vector<int> c;
+                for (int x : snap) c.push_back(x);
+                if (!std::is_sorted(c.begin(), c.end())) ++failures[t];
+                if (snap.find(-1) != snap.end()) ++failures[t];
+            }
+        });
+    }
+    for (int t = 0; t < 4; ++t) threads[t].join();
+    done = true;
+    for (int t = 4; t < 8; ++t) threads[t].join();
+
+    for (int t = 0; t < 4; ++t) EXPECT_EQ(failures[t], 0);
+    EXPECT_FALSE(cst.insert(1));
+    EXPECT_FALSE(cst.erase(3));
+
+    std::vector<int> c, expected;
+    for (int x : cst.snapshot()) c.push_back(x);
+    for (int t = 0; t < 4; ++t)
+        for (int i = 0; i < 300; ++i)
+            if (i % 3) expected.push_back(t * 1000 + i);
+    EXPECT_EQ(c, expected);
+}
+
+TEST(ConcurrentSet, readers_in_place) {
+    concurrent_persistent_set<int> cst;
+    for (int i = 0; i < 1000; i += 2) cst.insert(i);
+    std::atomic<bool> done {false};
+    std::vector<std::thread> threads;
+    std::vector<int> failures(4);
+
+    // Even keys stay; odd keys come and go.
+    threads.emplace_back([&cst] {
+        for (int round = 0; round < 20; ++round) {
+            for (int i = 1; i < 1000; i += 2) cst.insert(i);
+            for (int i = 1; i < 1000; i += 2) cst.erase(i);
+        }
+    });
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&cst, &done, &failures, t] {
+            while (!done) {
+                if (!cst.contains(t * 2)) ++failures[t];
+                if (cst.contains(-1)) ++failures[t];
+                bool sane = cst.read([](persistent_set<int, smart_atomic_pointer> const& s) {
+                    std::size_t n = 0, evens = 0;
+                    int last = -1;
+                    bool sorted = true;
+                    s.for_each([&](int x) {
+                        sorted = sorted && x > last;
+                        last = x;
+                        ++n;
+                        evens += x % 2 == 0;
+                    });
+                    return sorted && n == s.size() && evens == 500;
+                });
+                if (!sane) ++failures[t];
+                if (cst.size() < 500) ++failures[t];
+            }
+        });
+    }
+    threads[0].join();
+    done = true;
+    for (int t = 1; t < 5; ++t) threads[t].join();
+
+    for (int t = 0; t < 4; ++t) EXPECT_EQ(failures[t], 0);
+    EXPECT_EQ(cst.size(), 500u);
+    EXPECT_TRUE(cst.contains(998));
+    EXPECT_FALSE(cst.contains(999));
+}
+
+TEST(ConcurrentSet, nested_calls_keep_outer_version) {
+    using set_type = persistent_set<int, smart_atomic_pointer>;
+    concurrent_persistent_set<int> a, b;
+    for (int i = 0; i < 100; ++i) a.insert(i);
+
+    // Each erase retires the version the outer read holds, and enough of
+    // them retire to make every thread scan its list several times.
+    std::size_t seen = a.read([&](set_type const& s) {
+        for (int i = 0; i < 100; ++i) {
+            EXPECT_TRUE(b.insert(i));
+            EXPECT_TRUE(b.read([&](set_type const& t) { return t.contains(i) && a.contains(i + 1) != (i == 99); }));
+            EXPECT_TRUE(a.erase(i));
+        }
+        return s.size() + s.contains(99);
+    });
+    EXPECT_EQ(seen, 101u);
+    EXPECT_EQ(a.size(), 0u);
+    EXPECT_EQ(b.size(), 100u);
+
+    std::function<void(std::size_t)> nest = [&](std::size_t depth) {
+        a.read([&](set_type const&) {
+            nest(depth + 1);
+            return 0;
+        });
+    };
+    EXPECT_THROW(nest(0), std::runtime_error);
+    EXPECT_TRUE(b.contains(0));
+}
+
+TEST(SharedPtr_Iterator, forward_and_backward_scan) {
+    srand((unsigned)time(nullptr));
+    persistent_set<int> st;
+    std::set<int> rst;
+    for (int i = 0; i < 5000; ++i) {
+        int x = rand() % 20000;
+        st.insert(x);
+        rst.insert(x);
+    }
+
+    auto rit = rst.begin();
+    for (auto it = st.begin(); it != st.end(); ++it, ++rit) ASSERT_EQ(*it, *rit);
+    EXPECT_TRUE(rit == rst.end());
+
+    auto it = st.end();
+    for (auto rrit = rst.rbegin(); rrit != rst.rend(); ++rrit) ASSERT_EQ(*--it, *rrit);
+    EXPECT_TRUE(it == st.begin());
+}
+
+TEST(Unbalanced_Iterator, deep_path_spills_to_heap) {
+    persistent_set<int, smart_shared_pointer, unbalanced> st;
+    for (int i = 0; i < 300; ++i) st.insert(i);
+
+    int expected = 0;
+    for (int x : st) ASSERT_EQ(x, expected++);
+    EXPECT_EQ(expected, 300);
+
+    auto it = st.end();
+    while (it != st.begin()) ASSERT_EQ(*--it, --expected);
+    EXPECT_EQ(expected, 0);
+
+    it = st.find(299);
+    EXPECT_EQ(*it, 299);
+    EXPECT_TRUE(++it == st.end());
+}
+
+TEST(IntrusivePtr_Iterator, borrowed_iterators_hold_no_reference) {
+    using pooled_set = persistent_set<int, smart_intrusive_pointer, weight_balanced, pool_node_allocator>;
+    std::vector<int> v;
+    for (int i = 0; i < 1000; ++i) v.push_back(2 * i);
+    pooled_set st(sorted_unique, v.begin(), v.end());
+
+    auto view = st.borrow();
+    std::vector<int> seen(view.begin(), view.end());
+    EXPECT_EQ(seen, v);
+    EXPECT_EQ(*--view.end(), 1998);
+    EXPECT_EQ(*view.find(500), 500);
+    EXPECT_TRUE(view.find(501) == view.end());
+    EXPECT_EQ(*view.lower_bound(501), 502);
+    EXPECT_EQ(*view.upper_bound(502), 504);
+    EXPECT_TRUE(view.upper_bound(1998) == view.end());
+
+    // A borrowed iterator leaves the root unique, so the edit is in place;
+    // an ordinary one shares it, and the edit copies the path.
+    pooled_set::borrowed_iterator borrowed = view.find(700);
+    EXPECT_EQ(*++borrowed, 702);
+    std::size_t before = pool_node_allocator::stats().allocations;
+    st.insert(1);
+    EXPECT_EQ(pool_node_allocator::stats().allocations - before, 1u);
+
+    pooled_set::iterator held = st.find(700);
+    before = pool_node_allocator::stats().allocations;
+    st.insert(3);
+    EXPECT_GT(pool_node_allocator::stats().allocations - before, 1u);
+    EXPECT_EQ(*++held, 702);
+}
+
+TEST(SharedPtr_Insert, returned_iterator_walks) {
+    persistent_set<int> st;
+    for (int i = 0; i < 1000; i += 2) st.insert(i);
+
+    auto res = st.insert(501);
+    EXPECT_TRUE(res.second);
+    EXPECT_EQ(*res.first, 501);
+    auto it = res.first;
+    EXPECT_EQ(*++it, 502);
+    it = res.first;
+    EXPECT_EQ(*--it, 500);
+
+    res = st.insert(1000);
+    EXPECT_TRUE(res.second);
+    EXPECT_EQ(*res.first, 1000);
+    EXPECT_TRUE(++res.first == st.end());
+}
+
+TEST(SharedPtr_Insert, present_key_shares_version) {
+    persistent_set<int> st;
+    for (int i = 0; i < 100; ++i) st.insert(i);
+    persistent_set<int> sst(st);
+
+    auto res = st.insert(42);
+    EXPECT_FALSE(res.second);
+    EXPECT_EQ(*res.first, 42);
+    EXPECT_TRUE(st.end() == sst.end());
+
+    EXPECT_EQ(st.erase(1000), 0u);
+    EXPECT_TRUE(st.end() == sst.end());
+
+    EXPECT_EQ(st.erase(42), 1u);
+    EXPECT_TRUE(st.end() != sst.end());
+    EXPECT_TRUE(st.find(42) == st.end());
+    EXPECT_TRUE(sst.find(42) != sst.end());
+}
+
+struct counting_less {
+    using is_transparent = void;
+    static int string_compares;
+
+    bool operator () (std::string const& a, std::string const& b) const {
+        ++string_compares;
+        return a < b;
+    }
+
+    bool operator () (std::string const& a, char const* b) const {
+        return a.compare(b) < 0;
+    }
+
+    bool operator () (char const* a, std::string const& b) const {
+        return b.compare(a) > 0;
+    }
+};
+
+int counting_less::string_compares = 0;
+
+TEST(SharedPtr_Lookup, transparent_comparator) {
+    persistent_set<std::string, smart_shared_pointer, weight_balanced, default_node_allocator, std::less<>> st;
+    for (int i = 0; i < 100; ++i) st.insert(std::to_string(i));
+
+    EXPECT_TRUE(st.contains("42"));
+    EXPECT_FALSE(st.contains("420"));
+    EXPECT_EQ(st.count("7"), 1u);
+    EXPECT_EQ(*st.find("99"), "99");
+    EXPECT_TRUE(st.find("x") == st.end());
+#if __cplusplus >= 201703L
+    std::string_view key = "13";
+    EXPECT_TRUE(st.contains(key));
+#endif
+}
+
+TEST(SharedPtr_Lookup, heterogeneous_keys_do_not_convert) {
+    persistent_set<std::string, smart_linked_pointer, weight_balanced, default_node_allocator, counting_less> st;
+    for (int i = 0; i < 100; ++i) st.insert(std::to_string(i));
+    counting_less::string_compares = 0;
+    EXPECT_TRUE(st.contains("55"));
+    EXPECT_EQ(st.count("555"), 0u);
+    auto it = st.find("10");
+    EXPECT_EQ(*it, "10");
+    EXPECT_EQ(counting_less::string_compares, 0);
+    EXPECT_EQ(*++it, "11");
+}
+
+TEST(SharedPtr_Lookup, custom_order) {
+    persistent_set<int, smart_shared_pointer, weight_balanced, default_node_allocator, std::greater<int>> st;
+    for (int i = 0; i < 50; ++i) st.insert(i);
+    int expected = 49;
+    for (int x : st) ASSERT_EQ(x, expected--);
+    EXPECT_TRUE(st.contains(0));
+    EXPECT_EQ(st.erase(10), 1u);
+    EXPECT_EQ(st.count(10), 0u);
+}
+
+TEST(Unbalanced_Depth, degenerate_tree_edits) {
+    persistent_set<int, smart_shared_pointer, unbalanced> st;
+    for (int i = 0; i < 1500; ++i) st.insert(i);
+    persistent_set<int, smart_shared_pointer, unbalanced> sst(st);
+
+    for (int i = 0; i < 1500; i += 2) EXPECT_EQ(st.erase(i), 1u);
+    EXPECT_EQ(sst.erase(1499), 1u);
+    EXPECT_EQ(sst.erase(0), 1u);
+
+    int expected = 1;
+    for (int x : st) {
+        ASSERT_EQ(x, expected);
+        expected += 2;
+    }
+    EXPECT_EQ(expected, 1501);
+    expected = 1;
+    for (int x : sst) ASSERT_EQ(x, expected++);
+    EXPECT_EQ(expected, 1499);
+}
+
+TEST(Unbalanced_Depth, hundreds_of_thousands_of_keys) {
+    using chain_set = persistent_set<int, smart_shared_pointer, unbalanced>;
+    int const n = 300000;
+    // A union with one key below all the others puts that key on top of
+    // the tree in O(1), so this builds a chain n nodes deep in O(n) where
+    // inserting in order would take O(n^2).
+    chain_set chain;
+    for (int i = n; i-- > 0; ) {
+        chain_set single;
+        single.insert(i);
+        chain = set_union(single, chain);
+    }
+    ASSERT_EQ(chain.size(), static_cast<std::size_t>(n));
+
+    chain_set edited(chain);
+    EXPECT_TRUE(edited.insert(n).second);
+    EXPECT_EQ(edited.erase(n / 2), 1u);
+    EXPECT_EQ(edited.erase(n - 1), 1u);
+    EXPECT_TRUE(edited.contains(n));
+    EXPECT_FALSE(edited.contains(n / 2));
+    EXPECT_EQ(*edited.select(n - 2), n);
+    EXPECT_EQ(edited.size(), static_cast<std::size_t>(n - 1));
+
+    chain_set patched(chain);
+    std::vector<std::pair<int, batch_op>> batch {
+        {n / 3, batch_op::erase}, {n - 2, batch_op::insert}, {n + 5, batch_op::insert}};
+    EXPECT_EQ(patched.apply_batch(batch.begin(), batch.end()), 2u);
+    EXPECT_FALSE(patched.contains(n / 3));
+    EXPECT_TRUE(patched.contains(n + 5));
+    EXPECT_EQ(patched.size(), static_cast<std::size_t>(n));
+    EXPECT_TRUE(chain.contains(n / 3));
+
+    // With the chain on the left the set operations run down its whole
+    // depth.
+    chain_set extra;
+    extra.insert(n / 4);
+    extra.insert(n + 5);
+    chain_set joined = set_union(chain, extra);
+    EXPECT_EQ(joined.size(), static_cast<std::size_t>(n + 1));
+    EXPECT_TRUE(joined.contains(n + 5));
+    chain_set common = set_intersection(chain, extra);
+    EXPECT_EQ(common.size(), 1u);
+    EXPECT_TRUE(common.contains(n / 4));
+    chain_set rest = set_difference(chain, extra);
+    EXPECT_EQ(rest.size(), static_cast<std::size_t>(n - 1));
+    EXPECT_FALSE(rest.contains(n / 4));
+    EXPECT_EQ(*rest.select(n / 4), n / 4 + 1);
+
+    int expected = 0;
+    for (int x : chain) ASSERT_EQ(x, expected++);
+    EXPECT_EQ(expected, n);
+    std::size_t changes = 0;
+    diff(chain, edited, [&](int, batch_op) { ++changes; });
+    EXPECT_EQ(changes, 3u);
+    // Both versions are dropped here, node by node without recursing.
+}
+
+TEST(SharedPtr_Bulk, sorted_range_one_allocation_per_key) {
+    std::vector<int> v;
+    for (int i = 0; i < 10000; ++i) v.push_back(2 * i);
+    using pooled_set = persistent_set<int, smart_intrusive_pointer, weight_balanced, pool_node_allocator>;
+    std::size_t before = pool_node_allocator::stats().allocations;
+    pooled_set st(v.begin(), v.end());
+    EXPECT_EQ(pool_node_allocator::stats().allocations - before, v.size());
+
+    before = pool_node_allocator::stats().allocations;
+    pooled_set tagged(sorted_unique, v.begin(), v.end());
+    EXPECT_EQ(pool_node_allocator::stats().allocations - before, v.size());
+
+    auto it = st.begin();
+    for (int x : v) ASSERT_EQ(*it++, x);
+    EXPECT_TRUE(it == st.end());
+    EXPECT_TRUE(tagged.contains(19998));
+    EXPECT_FALSE(tagged.contains(1));
+
+    // The built tree stays balanced under further edits.
+    for (int i = 0; i < 10000; ++i) st.insert(2 * i + 1);
+    for (int i = 0; i < 20000; i += 3) EXPECT_EQ(st.erase(i), 1u);
+    int expected = 0;
+    for (int x : st) {
+        if (expected % 3 == 0) ++expected;
+        ASSERT_EQ(x, expected++);
+    }
+}
+
+TEST(SharedPtr_Bulk, unsorted_range_and_assign) {
+    std::vector<std::string> words;
+    for (int i = 0; i < 500; ++i) words.push_back(get_word());
+    words.push_back(words[7]);
+    words.push_back(words[0]);
+
+    persistent_set<std::string, smart_linked_pointer> st(words.begin(), words.end());
+    std::set<std::string> expected(words.begin(), words.end());
+    EXPECT_TRUE(std::equal(st.begin(), st.end(), expected.begin(), expected.end()));
+
+    persistent_set<std::string, smart_linked_pointer> old(st);
+    std::istringstream in("delta alpha charlie alpha bravo");
+    st.assign(std::istream_iterator<std::string>(in), std::istream_iterator<std::string>());
+    std::vector<std::string> got(st.begin(), st.end());
+    EXPECT_EQ(got, (std::vector<std::string> {"alpha", "bravo", "charlie", "delta"}));
+    EXPECT_TRUE(std::equal(old.begin(), old.end(), expected.begin(), expected.end()));
+
+    st.assign(words.end(), words.end());
+    EXPECT_TRUE(st.begin() == st.end());
+}
+
+// Checks shared by several configurations of a container run as typed
+// tests: a configuration names its set type and its name(), and each suite
+// below is config_test under the name of its container. Cases tied to one
+// configuration stay plain TESTs.
+template <typename Config>
+struct config_test : ::testing::Test {
+    using set = typename Config::set;
+};
+
+// Names typed tests after their configuration, as in Tree/Unbalanced.
+struct config_name {
+    template <typename Config>
+    static std::string GetName(int) {
+        return Config::name();
+    }
+};
+
+// Tree configurations the checks shared by every balance policy run
+// against.
+struct shared_weight_balanced {
+    using set = persistent_set<int, smart_shared_pointer, weight_balanced>;
+
+    template <typename augmentation>
+    using augmented_set = persistent_set<int, smart_shared_pointer, weight_balanced, default_node_allocator, std::less<int>,
+                                         augmentation>;
+
+    static std::string name() {
+        return "SharedPtr";
+    }
+};
+
+struct linked_unbalanced {
+    using set = persistent_set<int, smart_linked_pointer, unbalanced>;
+
+    template <typename augmentation>
+    using augmented_set = persistent_set<int, smart_linked_pointer, unbalanced, default_node_allocator, std::less<int>,
+                                         augmentation>;
+
+    static std::string name() {
+        return "Unbalanced";
+    }
+};
+
+template <typename Config>
+using Tree = config_test<Config>;
+
+using tree_configs = ::testing::Types<shared_weight_balanced, linked_unbalanced>;
+TYPED_TEST_SUITE(Tree, tree_configs, config_name);
+
+TYPED_TEST(Tree, random_batches) {
+    using Set = typename TestFixture::set;
+    std::mt19937 gen(913);
+    Set st;
+    std::set<int> expected;
+    for (int round = 0; round < 50; ++round) {
+        std::map<int, batch_op> updates;
+        int n = static_cast<int>(gen() % 400);
+        for (int i = 0; i < n; ++i)
+            updates[static_cast<int>(gen() % 3000)] = gen() % 3 ? batch_op::insert : batch_op::erase;
+        std::vector<std::pair<int, batch_op>> batch(updates.begin(), updates.end());
+
+        Set old(st);
+        std::set<int> old_expected(expected);
+        std::size_t changes = 0;
+        for (auto const& u : batch) {
+            if (u.second == batch_op::insert)
+                changes += expected.insert(u.first).second ? 1 : 0;
+            else
+                changes += expected.erase(u.first);
+        }
+        ASSERT_EQ(st.apply_batch(batch.begin(), batch.end()), changes);
+        ASSERT_TRUE(std::equal(st.begin(), st.end(), expected.begin(), expected.end()));
+        ASSERT_TRUE(std::equal(old.begin(), old.end(), old_expected.begin(), old_expected.end()));
+    }
+}
+
+TEST(SharedPtr_Batch, fewer_allocations_than_inserts) {
+    using pooled_set = persistent_set<int, smart_intrusive_pointer, weight_balanced, pool_node_allocator>;
+    std::vector<int> v;
+    for (int i = 0; i < 20000; ++i) v.push_back(3 * i);
+    pooled_set base(sorted_unique, v.begin(), v.end());
+
+    std::vector<std::pair<int, batch_op>> batch;
+    for (int i = 0; i < 5000; ++i) batch.push_back({6 * i + 1, batch_op::insert});
+
+    // Every intermediate version stays visible, so each insert copies its
+    // whole path.
+    pooled_set looped(base);
+    std::vector<pooled_set> versions;
+    std::size_t before = pool_node_allocator::stats().allocations;
+    for (auto const& u : batch) {
+        versions.push_back(looped);
+        looped.insert(u.first);
+    }
+    std::size_t loop_allocations = pool_node_allocator::stats().allocations - before;
+
+    pooled_set batched(base);
+    before = pool_node_allocator::stats().allocations;
+    EXPECT_EQ(batched.apply_batch(batch.begin(), batch.end()), batch.size());
+    std::size_t batch_allocations = pool_node_allocator::stats().allocations - before;
+
+    EXPECT_TRUE(std::equal(looped.begin(), looped.end(), batched.begin(), batched.end()));
+    EXPECT_LT(batch_allocations * 3, loop_allocations);
+    EXPECT_LE(batch_allocations, batch.size() + v.size());
+
+    // Erasing a whole range collapses the tree through merge and join.
+    batch.clear();
+    for (int i = 5000; i < 15000; ++i) batch.push_back({3 * i, batch_op::erase});
+    EXPECT_EQ(batched.apply_batch(batch.begin(), batch.end()), 10000u);
+    EXPECT_FALSE(batched.contains(15000));
+    EXPECT_TRUE(batched.contains(14997));
+    EXPECT_TRUE(batched.contains(45000));
+    EXPECT_TRUE(base.contains(15000));
+}
+
+TEST(SharedPtr_Transient, edits_in_place) {
+    using pooled_set = persistent_set<int, smart_intrusive_pointer, weight_balanced, pool_node_allocator>;
+    pooled_set::transient_set tr;
+    std::size_t before = pool_node_allocator::stats().allocations;
+    for (int i = 0; i < 5000; ++i) EXPECT_TRUE(tr.insert(i));
+    EXPECT_FALSE(tr.insert(17));
+    for (int i = 0; i < 5000; i += 2) EXPECT_EQ(tr.erase(i), 1u);
+    EXPECT_EQ(tr.erase(2), 0u);
+    EXPECT_EQ(pool_node_allocator::stats().allocations - before, 5000u);
+
+    pooled_set frozen = tr.persistent();
+    EXPECT_FALSE(tr.contains(1));
+    int expected = 1;
+    for (int x : frozen) {
+        ASSERT_EQ(x, expected);
+        expected += 2;
+    }
+    EXPECT_EQ(expected, 5001);
+}
+
+TEST(SharedPtr_Transient, versions_stay_untouched) {
+    persistent_set<std::string, smart_linked_pointer> base;
+    std::set<std::string> expected;
+    for (int i = 0; i < 300; ++i) {
+        std::string w = get_word();
+        base.insert(w);
+        expected.insert(w);
+    }
+
+    auto tr = base.transient();
+    for (int i = 0; i < 300; ++i) tr.insert(get_word());
+    for (auto const& w : expected) tr.erase(w);
+    auto first = tr.persistent();
+    EXPECT_TRUE(std::equal(base.begin(), base.end(), expected.begin(), expected.end()));
+
+    // A later transient over the frozen version copies its nodes again.
+    std::vector<std::string> frozen(first.begin(), first.end());
+    auto second = first.transient();
+    for (auto const& w : frozen) EXPECT_EQ(second.erase(w), 1u);
+    second.insert("x");
+    EXPECT_TRUE(std::equal(first.begin(), first.end(), frozen.begin(), frozen.end()));
+    auto last = second.persistent();
+    EXPECT_EQ(std::distance(last.begin(), last.end()), 1);
+
+    // So does the drained transient itself.
+    tr.insert(frozen.front());
+    EXPECT_TRUE(tr.contains(frozen.front()));
+    EXPECT_TRUE(std::equal(first.begin(), first.end(), frozen.begin(), frozen.end()));
+}
+
+// Pooled sets under each pointer policy, whose allocations the checks of
+// in-place reuse count.
+struct intrusive_pooled {
+    using set = persistent_set<int, smart_intrusive_pointer, weight_balanced, pool_node_allocator>;
+
+    static std::string name() {
+        return "IntrusivePtr";
+    }
+};
+
+struct linked_pooled {
+    using set = persistent_set<int, smart_linked_pointer, weight_balanced, pool_node_allocator>;
+
+    static std::string name() {
+        return "SmartLinkedPtr";
+    }
+};
+
+struct std_shared_pooled {
+    using set = persistent_set<int, std::shared_ptr, weight_balanced, pool_node_allocator>;
+
+    static std::string name() {
+        return "StdSharedPtr";
+    }
+};
+
+struct shared_pooled {
+    using set = persistent_set<int, smart_shared_pointer, weight_balanced, pool_node_allocator>;
+
+    static std::string name() {
+        return "SharedPtr";
+    }
+};
+
+template <typename Config>
+using Unique = config_test<Config>;
+
+using unique_configs = ::testing::Types<intrusive_pooled, linked_pooled, std_shared_pooled, shared_pooled>;
+TYPED_TEST_SUITE(Unique, unique_configs, config_name);
+
+TYPED_TEST(Unique, edits_reuse_owned_nodes) {
+    using pooled_set = typename TestFixture::set;
+    pooled_set st;
+    std::size_t before = pool_node_allocator::stats().allocations;
+    for (int i = 0; i < 4000; ++i) st.insert(i);
+    for (int i = 0; i < 4000; i += 2) st.erase(i);
+    EXPECT_EQ(pool_node_allocator::stats().allocations - before, 4000u);
+
+    // A second owner of the root turns copying back on.
+    pooled_set snapshot(st);
+    auto it = st.find(1001);
+    st.insert(-1);
+    st.erase(1001);
+    EXPECT_EQ(*it, 1001);
+    EXPECT_EQ(*++it, 1003);
+    EXPECT_TRUE(snapshot.contains(1001));
+    EXPECT_FALSE(snapshot.contains(-1));
+    EXPECT_FALSE(st.contains(1001));
+
+    // Once the snapshot and the iterator are gone, the tree is owned again.
+    snapshot = pooled_set();
+    it = pooled_set().end();
+    before = pool_node_allocator::stats().allocations;
+    st.insert(5001);
+    st.erase(3001);
+    EXPECT_EQ(pool_node_allocator::stats().allocations - before, 1u);
+    int expected = -1;
+    for (int x : st) {
+        ASSERT_EQ(x, expected);
+        expected = expected == -1 ? 1 : expected + 2;
+        if (expected == 1001 || expected == 3001) expected += 2;
+        if (expected == 4001) expected = 5001;
+    }
+    EXPECT_EQ(expected, 5003);
+}
+
+TEST(SmartLinkedPtr_Unique, use_count) {
+    smart_linked_pointer<int> c(new int(2));
+    smart_linked_pointer<int> d(c), e(d);
+    EXPECT_EQ(c.use_count(), 3);
+    EXPECT_EQ(e.use_count(), 3);
+    d = nullptr;
+    EXPECT_EQ(c.use_count(), 2);
+    e = nullptr;
+    EXPECT_TRUE(c.unique());
+
+    smart_atomic_pointer<int> f(new int(3));
+    smart_atomic_pointer<int> g(f);
+    EXPECT_EQ(g.use_count(), 2);
+    f = nullptr;
+    EXPECT_TRUE(g.unique());
+}
+
+// Key whose copies start failing once a countdown runs out.
+struct fragile_key {
+    int x {};
+    static int copies_left;
+
+    fragile_key() = default;
+
+    explicit fragile_key(int x) : x(x) {}
+
+    fragile_key(fragile_key const& other) : x(other.x) {
+        if (copies_left > 0 && --copies_left == 0) throw std::runtime_error("copy failed");
+    }
+
+    fragile_key& operator = (fragile_key const& other) = default;
+
+    bool operator < (fragile_key const& other) const {
+        return x < other.x;
+    }
+};
+
+int fragile_key::copies_left = 0;
+
+TEST(SharedPtr_Unique, failed_edit_leaves_tree_unchanged) {
+    using fragile_set = persistent_set<fragile_key>;
+    std::mt19937 gen(77);
+    fragile_set::transient_set tr;
+    std::set<int> expected;
+    int failures = 0;
+    for (int round = 0; round < 3000; ++round) {
+        int x = static_cast<int>(gen() % 500);
+        bool add = gen() % 3 != 0;
+        fragile_key::copies_left = static_cast<int>(gen() % 6);
+        try {
+            if (add) tr.insert(fragile_key(x)); else tr.erase(fragile_key(x));
+            fragile_key::copies_left = 0;
+            if (add) expected.insert(x); else expected.erase(x);
+        } catch (std::runtime_error const&) {
+            fragile_key::copies_left = 0;
+            ++failures;
+            ASSERT_EQ(tr.size(), expected.size());
+            for (int y = 0; y < 500; ++y) ASSERT_EQ(tr.contains(fragile_key(y)), expected.count(y) == 1);
+        }
+        if (round % 100 == 0) {
+            fragile_set frozen = tr.persistent();
+            std::vector<int> keys;
+            for (auto const& v : frozen) keys.push_back(v.x);
+            EXPECT_EQ(keys, std::vector<int>(expected.begin(), expected.end()));
+            tr = frozen.transient();
+        }
+    }
+    EXPECT_GT(failures, 0);
+}
+
+// Allocator whose allocations start failing once a countdown runs out.
+struct failing_allocator {
+    static int allocations_left;
+
+    static void* allocate(std::size_t size) {
+        if (allocations_left > 0 && --allocations_left == 0) throw std::bad_alloc();
+        return ::operator new(size);
+    }
+
+    static void deallocate(void* p, std::size_t) noexcept {
+        ::operator delete(p);
+    }
+};
+
+int failing_allocator::allocations_left = 0;
+
+TEST(SharedPtr_Unique, failed_allocation_leaves_tree_unchanged) {
+    using failing_set = persistent_set<int, smart_shared_pointer, weight_balanced, failing_allocator>;
+    std::mt19937 gen(181);
+    failing_set s;
+    std::set<int> expected;
+    for (int i = 0; i < 181; ++i) {
+        int x = static_cast<int>(gen() % 1000);
+        s.insert(x);
+        expected.insert(x);
+    }
+    failing_set older;
+    int failures = 0;
+    for (int round = 0; round < 30000; ++round) {
+        int x = static_cast<int>(gen() % 1000);
+        bool add = gen() % 2 != 0;
+        // An older version shares part of the tree, so that edits copy part
+        // of their path and relink the rest in place.
+        if (round % 2 == 0) older = s;
+        failing_allocator::allocations_left = static_cast<int>(gen() % 3);
+        try {
+            if (add) s.insert(x); else s.erase(x);
+            failing_allocator::allocations_left = 0;
+            if (add) expected.insert(x); else expected.erase(x);
+        } catch (std::bad_alloc const&) {
+            failing_allocator::allocations_left = 0;
+            ++failures;
+        }
+        ASSERT_EQ(s.size(), expected.size());
+        ASSERT_TRUE(std::equal(s.begin(), s.end(), expected.begin()));
+    }
+    EXPECT_GT(failures, 0);
+}
+
+// Sum whose copies start failing once a countdown runs out. Moves never
+// throw, as augmentation policies require.
+struct fragile_sum {
+    struct type {
+        long long v {};
+        static int copies_left;
+
+        type() = default;
+
+        explicit type(long long v) noexcept : v(v) {}
+
+        type(type const& other) : v(other.v) {
+            if (copies_left > 0 && --copies_left == 0) throw std::runtime_error("copy failed");
+        }
+
+        type(type&&) noexcept = default;
+        type& operator = (type const&) = default;
+        type& operator = (type&&) noexcept = default;
+    };
+
+    static type identity() noexcept {
+        return type();
+    }
+
+    static type of(int key) noexcept {
+        return type(key);
+    }
+
+    static type combine(type const& a, type const& b) noexcept {
+        return type(a.v + b.v);
+    }
+};
+
+int fragile_sum::type::copies_left = 0;
+
+TEST(Unbalanced_Unique, failed_deep_edit_restores_sizes_and_aggregates) {
+    using chain_set = persistent_set<int, smart_shared_pointer, unbalanced, default_node_allocator,
+                                     std::less<int>, fragile_sum>;
+    int const n = 2000;
+    chain_set::transient_set tr;
+    std::set<int> expected;
+    for (int i = n - 1; i >= 0; --i) {
+        tr.insert(2 * i);
+        expected.insert(2 * i);
+    }
+    std::mt19937 gen(15);
+    int failures = 0;
+    for (int round = 0; round < 40; ++round) {
+        // Keys near the bottom of the chain, so the edit rebuilds hundreds
+        // of owned nodes in place before a copy fails.
+        bool add = round % 2 == 0;
+        int x = add ? 2 * static_cast<int>(gen() % 200) + 1
+                    : *std::next(expected.begin(), static_cast<long>(gen() % 200));
+        fragile_sum::type::copies_left = 200 + static_cast<int>(gen() % 400);
+        try {
+            if (add) tr.insert(x); else tr.erase(x);
+            fragile_sum::type::copies_left = 0;
+            if (add) expected.insert(x); else expected.erase(x);
+        } catch (std::runtime_error const&) {
+            fragile_sum::type::copies_left = 0;
+            ++failures;
+        }
+        ASSERT_EQ(tr.size(), expected.size());
+    }
+    EXPECT_GT(failures, 0);
+
+    chain_set frozen = tr.persistent();
+    std::vector<int> keys(expected.begin(), expected.end());
+    ASSERT_EQ(frozen.size(), keys.size());
+    EXPECT_TRUE(std::equal(frozen.begin(), frozen.end(), keys.begin()));
+    for (std::size_t i = 0; i < keys.size(); i += 7) {
+        EXPECT_EQ(*frozen.select(i), keys[i]);
+        EXPECT_EQ(frozen.rank(keys[i]), i);
+    }
+    // Erasing the largest key each time takes the tree apart from the top
+    // down, so every node's size and aggregate ends up read at the root.
+    long long sum = 0;
+    for (int k : keys) sum += k;
+    while (!keys.empty()) {
+        ASSERT_EQ(frozen.size(), keys.size());
+        ASSERT_EQ(frozen.aggregate().v, sum);
+        sum -= keys.back();
+        frozen.erase(keys.back());
+        keys.pop_back();
+    }
+}
+
+// Key counting its copies.
+struct counted_key {
+    int x {};
+    static int copies;
+
+    explicit counted_key(int x) : x(x) {}
+
+    counted_key(counted_key const& other) : x(other.x) {
+        ++copies;
+    }
+
+    counted_key& operator = (counted_key const& other) = default;
+
+    bool operator < (counted_key const& other) const {
+        return x < other.x;
+    }
+};
+
+int counted_key::copies = 0;
+
+template <>
+struct shares_key<counted_key> : std::true_type {};
+
+struct large_key {
+    char bytes[128];
+};
+
+static_assert(!shares_key<int>::value, "ints are kept in the node");
+static_assert(!shares_key<std::string>::value, "strings are kept in the node unless opted in");
+static_assert(shares_key<large_key>::value, "large keys are shared between path copies");
+
+// Sets of shared keys under pointer policies of each kind.
+struct shared_key_storage {
+    using set = persistent_set<counted_key>;
+
+    static std::string name() {
+        return "SharedPtr";
+    }
+};
+
+struct intrusive_key_storage {
+    using set = persistent_set<counted_key, smart_intrusive_pointer>;
+
+    static std::string name() {
+        return "IntrusivePtr";
+    }
+};
+
+struct atomic_key_storage {
+    using set = persistent_set<counted_key, smart_atomic_pointer>;
+
+    static std::string name() {
+        return "AtomicPtr";
+    }
+};
+
+template <typename Config>
+using KeyStorage = config_test<Config>;
+
+using key_storage_configs = ::testing::Types<shared_key_storage, intrusive_key_storage, atomic_key_storage>;
+TYPED_TEST_SUITE(KeyStorage, key_storage_configs, config_name);
+
+// Every version stays alive, so each edit copies its whole path; keys are
+// still copied only when they enter the set.
+TYPED_TEST(KeyStorage, path_copies_share_keys) {
+    using Set = typename TestFixture::set;
+    std::mt19937 gen(31);
+    std::vector<Set> versions(1);
+    std::set<int> expected;
+    counted_key::copies = 0;
+    int added = 0;
+    for (int round = 0; round < 3000; ++round) {
+        Set next = versions.back();
+        counted_key k(static_cast<int>(gen() % 1000));
+        if (gen() % 4) {
+            if (next.insert(k).second) ++added;
+            expected.insert(k.x);
+        } else {
+            next.erase(k);
+            expected.erase(k.x);
+        }
+        versions.push_back(std::move(next));
+    }
+    EXPECT_EQ(counted_key::copies, added);
+    std::vector<int> keys;
+    for (auto const& k : versions.back()) keys.push_back(k.x);
+    EXPECT_TRUE(std::equal(keys.begin(), keys.end(), expected.begin(), expected.end()));
+    EXPECT_EQ(versions.back().size(), expected.size());
+}
+
+// Kept apart from its typed test for the parallel case further down,
+// which needs a thread-safe pointer policy.
+template <typename Set>
+static void check_set_algebra(int rounds, int range, parallelism par = parallelism::none()) {
+    std::mt19937 gen(2024);
+    for (int round = 0; round < rounds; ++round) {
+        std::set<int> ea, eb;
+        Set a, b;
+        int na = static_cast<int>(gen() % (round < 5 ? 10 : range)), nb = static_cast<int>(gen() % range);
+        for (int i = 0; i < na; ++i) {
+            int x = static_cast<int>(gen() % range);
+            a.insert(x);
+            ea.insert(x);
+        }
+        if (round % 2) {
+            // b derived from a, sharing most of its nodes.
+            b = a;
+            eb = ea;
+        }
+        for (int i = 0; i < nb; ++i) {
+            int x = static_cast<int>(gen() % range);
+            if (gen() % 2) {
+                b.insert(x);
+                eb.insert(x);
+            } else {
+                b.erase(x);
+                eb.erase(x);
+            }
+        }
+
+        std::vector<int> expected;
+        std::set_union(ea.begin(), ea.end(), eb.begin(), eb.end(), std::back_inserter(expected));
+        Set u = set_union(a, b, par);
+        ASSERT_TRUE(std::equal(u.begin(), u.end(), expected.begin(), expected.end()));
+
+        expected.clear();
+        std::set_intersection(ea.begin(), ea.end(), eb.begin(), eb.end(), std::back_inserter(expected));
+        Set i = set_intersection(a, b, par);
+        ASSERT_TRUE(std::equal(i.begin(), i.end(), expected.begin(), expected.end()));
+
+        expected.clear();
+        std::set_difference(ea.begin(), ea.end(), eb.begin(), eb.end(), std::back_inserter(expected));
+        Set d = set_difference(a, b, par);
+        ASSERT_TRUE(std::equal(d.begin(), d.end(), expected.begin(), expected.end()));
+
+        // The operands are left alone, and results stay editable.
+        ASSERT_TRUE(std::equal(a.begin(), a.end(), ea.begin(), ea.end()));
+        ASSERT_TRUE(std::equal(b.begin(), b.end(), eb.begin(), eb.end()));
+        u.insert(-1);
+        if (!ea.empty()) d.erase(*ea.begin());
+        ASSERT_TRUE(std::equal(a.begin(), a.end(), ea.begin(), ea.end()));
+    }
+}
+
+TYPED_TEST(Tree, random_set_algebra) {
+    check_set_algebra<typename TestFixture::set>(60, 400);
+}
+
+// Records which threads allocate nodes.
+struct thread_recording_allocator {
+    static std::mutex mutex;
+    static std::set<std::thread::id> threads;
+
+    static void* allocate(std::size_t size) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.insert(std::this_thread::get_id());
+        }
+        return ::operator new(size);
+    }
+
+    static void deallocate(void* p, std::size_t) noexcept {
+        ::operator delete(p);
+    }
+};
+
+std::mutex thread_recording_allocator::mutex;
+std::set<std::thread::id> thread_recording_allocator::threads;
+
+TEST(AtomicPtr_Algebra, large_sets_in_parallel) {
+    // Forks two levels deep whatever the number of cores.
+    using recorded_set = persistent_set<int, smart_atomic_pointer, weight_balanced, thread_recording_allocator>;
+    thread_recording_allocator::threads.clear();
+    check_set_algebra<recorded_set>(4, 60000, parallelism {2, 1024});
+    EXPECT_GT(thread_recording_allocator::threads.size(), 1u);
+
+    thread_recording_allocator::threads.clear();
+    check_set_algebra<recorded_set>(4, 60000, parallelism::none());
+    EXPECT_EQ(thread_recording_allocator::threads.size(), 1u);
+}
+
+TEST(IntrusivePtr_Algebra, shared_subtrees_are_skipped) {
+    using pooled_set = persistent_set<int, smart_intrusive_pointer, weight_balanced, pool_node_allocator>;
+    std::vector<int> v;
+    for (int i = 0; i < 100000; ++i) v.push_back(2 * i);
+    pooled_set a(sorted_unique, v.begin(), v.end());
+    pooled_set b(a);
+    b.insert(777);
+    b.erase(5000);
+
+    std::size_t before = pool_node_allocator::stats().allocations;
+    pooled_set u = set_union(a, b);
+    pooled_set i = set_intersection(a, b);
+    pooled_set d = set_difference(b, a);
+    EXPECT_LT(pool_node_allocator::stats().allocations - before, 500u);
+
+    EXPECT_TRUE(u.contains(777));
+    EXPECT_TRUE(u.contains(5000));
+    EXPECT_FALSE(i.contains(777));
+    EXPECT_FALSE(i.contains(5000));
+    EXPECT_TRUE(i.contains(5002));
+    std::vector<int> only_b(d.begin(), d.end());
+    EXPECT_EQ(only_b, std::vector<int> {777});
+}
+
+TYPED_TEST(Tree, random_diffs) {
+    using Set = typename TestFixture::set;
+    std::mt19937 gen(31337);
+    Set a;
+    for (int i = 0; i < 2000; ++i) a.insert(static_cast<int>(gen() % 5000));
+    for (int round = 0; round < 40; ++round) {
+        Set b = round % 4 ? a : Set();
+        int edits = static_cast<int>(gen() % (round % 4 ? 50 : 3000));
+        for (int i = 0; i < edits; ++i) {
+            int x = static_cast<int>(gen() % 5000);
+            if (gen() % 2) b.insert(x); else b.erase(x);
+        }
+
+        std::vector<std::pair<int, batch_op>> delta;
+        diff(a, b, [&delta](int x, batch_op op) { delta.push_back({x, op}); });
+
+        std::vector<int> removed, added, got_removed, got_added;
+        std::set_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(removed));
+        std::set_difference(b.begin(), b.end(), a.begin(), a.end(), std::back_inserter(added));
+        for (std::size_t i = 0; i < delta.size(); ++i) {
+            if (i > 0) {
+                ASSERT_LT(delta[i - 1].first, delta[i].first);
+            }
+            (delta[i].second == batch_op::erase ? got_removed : got_added).push_back(delta[i].first);
+        }
+        ASSERT_EQ(got_removed, removed);
+        ASSERT_EQ(got_added, added);
+
+        Set replica(a);
+        replica.apply_batch(delta.begin(), delta.end());
+        ASSERT_TRUE(std::equal(replica.begin(), replica.end(), b.begin(), b.end()));
+        a = b;
+    }
+}
+
+struct counting_int_less {
+    static int compares;
+
+    bool operator () (int a, int b) const {
+        ++compares;
+        return a < b;
+    }
+};
+
+int counting_int_less::compares = 0;
+
+TEST(SharedPtr_Diff, cost_follows_the_change) {
+    using counted_set = persistent_set<int, smart_shared_pointer, weight_balanced, default_node_allocator,
+                                       counting_int_less>;
+    std::vector<int> v;
+    for (int i = 0; i < 200000; ++i) v.push_back(i);
+    counted_set a(sorted_unique, v.begin(), v.end());
+    counted_set b(a);
+    b.erase(100);
+    b.insert(-5);
+    b.erase(150000);
+
+    counting_int_less::compares = 0;
+    std::vector<std::pair<int, batch_op>> delta;
+    diff(a, b, [&delta](int x, batch_op op) { delta.push_back({x, op}); });
+    EXPECT_LT(counting_int_less::compares, 500);
+    std::vector<std::pair<int, batch_op>> expected {
+        {-5, batch_op::insert}, {100, batch_op::erase}, {150000, batch_op::erase}};
+    EXPECT_EQ(delta, expected);
+
+    delta.clear();
+    diff(b, b, [&delta](int x, batch_op op) { delta.push_back({x, op}); });
+    EXPECT_TRUE(delta.empty());
+}
+
+TYPED_TEST(Tree, order_statistics) {
+    using Set = typename TestFixture::set;
+    std::mt19937 gen(606);
+    Set st;
+    std::set<int> expected;
+    EXPECT_TRUE(st.empty());
+    EXPECT_TRUE(st.select(0) == st.end());
+    for (int round = 0; round < 3000; ++round) {
+        int x = static_cast<int>(gen() % 2000);
+        if (gen() % 3) {
+            st.insert(x);
+            expected.insert(x);
+        } else {
+            st.erase(x);
+            expected.erase(x);
+        }
+        ASSERT_EQ(st.size(), expected.size());
+    }
+
+    std::vector<int> keys(expected.begin(), expected.end());
+    for (std::size_t k = 0; k < keys.size(); ++k) {
+        auto it = st.select(k);
+        ASSERT_EQ(*it, keys[k]);
+        ASSERT_EQ(st.rank(keys[k]), k);
+        if (k + 1 < keys.size()) {
+            ASSERT_EQ(*++it, keys[k + 1]);
+        }
+    }
+    EXPECT_TRUE(st.select(keys.size()) == st.end());
+    EXPECT_TRUE(--st.select(keys.size() - 1) == st.select(keys.size() - 2));
+
+    for (int i = 0; i < 500; ++i) {
+        int lo = static_cast<int>(gen() % 2100) - 50, hi = static_cast<int>(gen() % 2100) - 50;
+        std::size_t below_lo = std::lower_bound(keys.begin(), keys.end(), lo) - keys.begin();
+        std::size_t below_hi = std::lower_bound(keys.begin(), keys.end(), hi) - keys.begin();
+        ASSERT_EQ(st.rank(lo), below_lo);
+        ASSERT_EQ(st.count_range(lo, hi), below_hi > below_lo ? below_hi - below_lo : 0);
+    }
+}
+
+TEST(SharedPtr_OrderStatistics, sizes_after_bulk_operations) {
+    std::vector<int> v;
+    for (int i = 0; i < 1000; ++i) v.push_back(i);
+    persistent_set<int> a(v.begin(), v.end());
+    EXPECT_EQ(a.size(), 1000u);
+    EXPECT_EQ(*a.select(500), 500);
+
+    std::vector<std::pair<int, batch_op>> batch {{-1, batch_op::insert}, {10, batch_op::erase},
+                                                 {2000, batch_op::insert}};
+    persistent_set<int> b(a);
+    b.apply_batch(batch.begin(), batch.end());
+    EXPECT_EQ(b.size(), 1001u);
+    EXPECT_EQ(set_union(a, b).size(), 1002u);
+    EXPECT_EQ(set_intersection(a, b).size(), 999u);
+    EXPECT_EQ(set_difference(a, b).size(), 1u);
+
+    auto tr = b.transient();
+    for (int i = 0; i < 100; ++i) tr.erase(i);
+    EXPECT_EQ(tr.size(), 902u);
+    EXPECT_EQ(tr.persistent().count_range(0, 1000), 900u);
+}
+
+TYPED_TEST(Tree, bounds_against_std_set) {
+    using Set = typename TestFixture::set;
+    std::mt19937 gen(4242);
+    Set st;
+    std::set<int> expected;
+    for (int i = 0; i < 1500; ++i) {
+        int x = static_cast<int>(gen() % 4000);
+        st.insert(x);
+        expected.insert(x);
+    }
+    auto same = [&st, &expected](typename Set::iterator it, std::set<int>::const_iterator e) {
+        if (e == expected.end()) return it == st.end();
+        return it != st.end() && *it == *e;
+    };
+    for (int k = -10; k < 4010; ++k) {
+        ASSERT_TRUE(same(st.lower_bound(k), expected.lower_bound(k)));
+        ASSERT_TRUE(same(st.upper_bound(k), expected.upper_bound(k)));
+        auto er = st.equal_range(k);
+        ASSERT_EQ(std::distance(er.first, er.second), static_cast<std::ptrdiff_t>(expected.count(k)));
+    }
+    // Iterators from a bound step both ways.
+    auto it = st.lower_bound(2000);
+    auto e = expected.lower_bound(2000);
+    for (int i = 0; i < 50; ++i) ASSERT_EQ(*--it, *--e);
+    for (int i = 0; i < 100; ++i) ASSERT_EQ(*++it, *++e);
+
+    for (int i = 0; i < 300; ++i) {
+        int lo = static_cast<int>(gen() % 4100) - 50, hi = static_cast<int>(gen() % 4100) - 50;
+        std::vector<int> got;
+        for (int x : st.range(lo, hi)) got.push_back(x);
+        std::vector<int> want;
+        for (int x : expected) {
+            if (x >= lo && x < hi) want.push_back(x);
+        }
+        ASSERT_EQ(got, want);
+        ASSERT_EQ(st.range(lo, hi).empty(), want.empty());
+        ASSERT_EQ(got.size(), st.count_range(lo, hi));
+        got.clear();
+        st.for_each(lo, hi, [&got](int x) { got.push_back(x); });
+        ASSERT_EQ(got, want);
+    }
+    std::vector<int> all;
+    st.for_each([&all](int x) { all.push_back(x); });
+    EXPECT_TRUE(std::equal(all.begin(), all.end(), expected.begin(), expected.end()));
+}
+
+TEST(SharedPtr_Bounds, transparent_keys) {
+    persistent_set<std::string, smart_shared_pointer, weight_balanced, default_node_allocator, std::less<>> st;
+    for (char c = 'a'; c <= 'z'; ++c) st.insert(std::string(2, c));
+    EXPECT_EQ(*st.lower_bound("m"), "mm");
+    EXPECT_EQ(*st.upper_bound("mm"), "nn");
+    std::string joined;
+    for (auto const& w : st.range("x", "zz")) joined += w;
+    EXPECT_EQ(joined, "xxyy");
+}
+
+TYPED_TEST(Tree, range_sums) {
+    using Set = typename TypeParam::template augmented_set<sum_augmentation<long long>>;
+    std::mt19937 gen(99);
+    Set st;
+    std::set<int> expected;
+    std::vector<std::pair<Set, std::set<int>>> versions;
+    for (int round = 0; round < 3000; ++round) {
+        int x = static_cast<int>(gen() % 3000) - 1000;
+        if (gen() % 3) {
+            st.insert(x);
+            expected.insert(x);
+        } else {
+            st.erase(x);
+            expected.erase(x);
+        }
+        if (round % 500 == 0) versions.push_back({st, expected});
+    }
+    versions.push_back({st, expected});
+
+    for (auto const& v : versions) {
+        long long total = 0;
+        for (int x : v.second) total += x;
+        ASSERT_EQ(v.first.aggregate(), total);
+        for (int i = 0; i < 200; ++i) {
+            int lo = static_cast<int>(gen() % 3200) - 1100, hi = static_cast<int>(gen() % 3200) - 1100;
+            long long sum = 0;
+            for (auto it = v.second.lower_bound(lo); it != v.second.end() && *it < hi; ++it) sum += *it;
+            ASSERT_EQ(v.first.aggregate(lo, hi), sum);
+        }
+    }
+}
+
+struct reading {
+    int time;
+    int value;
+
+    bool operator < (reading const& other) const {
+        return time < other.time;
+    }
+};
+
+// Largest value of the readings in a subtree.
+struct max_value {
+    using type = int;
+
+    static type identity() noexcept {
+        return std::numeric_limits<int>::min();
+    }
+
+    static type of(reading const& r) noexcept {
+        return r.value;
+    }
+
+    static type combine(type a, type b) noexcept {
+        return std::max(a, b);
+    }
+};
+
+// Keys in order, to catch a fold that mixes up sides. Kept in a fixed
+// buffer, since combining must not allocate.
+struct concatenation {
+    struct type {
+        char text[32];
+        std::size_t length;
+
+        operator std::string() const {
+            return std::string(text, length);
+        }
+    };
+
+    static type identity() noexcept {
+        return {{}, 0};
+    }
+
+    static type of(char c) noexcept {
+        return {{c}, 1};
+    }
+
+    static type combine(type const& a, type const& b) noexcept {
+        type ab = a;
+        std::size_t n = std::min(b.length, sizeof(ab.text) - ab.length);
+        std::copy(b.text, b.text + n, ab.text + ab.length);
+        ab.length += n;
+        return ab;
+    }
+};
+
+TEST(SharedPtr_Augmentation, custom_policies) {
+    using readings = persistent_set<reading, smart_shared_pointer, weight_balanced, default_node_allocator,
+                                    std::less<reading>, max_value>;
+    std::vector<reading> v;
+    for (int t = 0; t < 1000; ++t) v.push_back({t, (t * 37) % 1001});
+    readings rs(sorted_unique, v.begin(), v.end());
+    auto brute_max = [&rs](int lo, int hi) {
+        int best = std::numeric_limits<int>::min();
+        for (auto const& r : rs) {
+            if (r.time >= lo && r.time < hi) best = std::max(best, r.value);
+        }
+        return best;
+    };
+    EXPECT_EQ(rs.aggregate(), 1000);
+    EXPECT_EQ(rs.aggregate({100, 0}, {200, 0}), brute_max(100, 200));
+    rs.erase({108, 0});
+    EXPECT_EQ(rs.aggregate({100, 0}, {200, 0}), brute_max(100, 200));
+    EXPECT_EQ(rs.aggregate({5, 0}, {5, 0}), std::numeric_limits<int>::min());
+
+    using letters = persistent_set<char, smart_intrusive_pointer, weight_balanced, default_node_allocator,
+                                   std::less<char>, concatenation>;
+    std::string alphabet = "qwertyuiopasdfghjklzxcvbnm";
+    letters ls;
+    auto tr = ls.transient();
+    for (char c : alphabet) tr.insert(c);
+    ls = tr.persistent();
+    EXPECT_EQ(std::string(ls.aggregate()), "abcdefghijklmnopqrstuvwxyz");
+    EXPECT_EQ(std::string(ls.aggregate('d', 'k')), "defghij");
+    std::vector<std::pair<char, batch_op>> batch {{'a', batch_op::erase}, {'e', batch_op::erase},
+                                                  {'z', batch_op::erase}};
+    ls.apply_batch(batch.begin(), batch.end());
+    EXPECT_EQ(std::string(ls.aggregate('a', 'k')), "bcdfghij");
+    std::string vowels = "aeiou";
+    letters vs(vowels.begin(), vowels.end());
+    EXPECT_EQ(std::string(set_union(ls, vs).aggregate()), "abcdefghijklmnopqrstuvwxy");
+    EXPECT_EQ(std::string(set_difference(ls, vs).aggregate('a', 'z')), "bcdfghjklmnpqrstvwxy");
+}
+
+// B-tree configurations: node widths at both ends and an odd one, and a
+// descending order.
+struct narrow_btree {
+    using set = persistent_btree_set<int, smart_shared_pointer, default_node_allocator, std::less<int>, 4>;
+
+    static std::string name() {
+        return "SharedPtr_Width4";
+    }
+};
+
+struct wide_btree {
+    using set = persistent_btree_set<int>;
+
+    static std::string name() {
+        return "SharedPtr_Width32";
+    }
+};
+
+struct odd_width_btree {
+    using set = persistent_btree_set<int, smart_intrusive_pointer, pool_node_allocator, std::less<int>, 7>;
+
+    static std::string name() {
+        return "IntrusivePtr_Width7";
+    }
+};
+
+struct descending_btree {
+    using set = persistent_btree_set<int, smart_linked_pointer, default_node_allocator, std::greater<int>, 5>;
+
+    static std::string name() {
+        return "SmartLinkedPtr_Descending";
+    }
+};
+
+template <typename Config>
+using BTree = config_test<Config>;
+
+using btree_configs = ::testing::Types<narrow_btree, wide_btree, odd_width_btree, descending_btree>;
+TYPED_TEST_SUITE(BTree, btree_configs, config_name);
+
+TYPED_TEST(BTree, against_std_set) {
+    using Set = typename TestFixture::set;
+    int const rounds = 6000, range = 3000;
+    std::mt19937 gen(1701);
+    using reference_set = std::set<int, typename Set::key_compare>;
+    Set st;
+    reference_set expected;
+    std::vector<std::pair<Set, reference_set>> versions;
+    for (int round = 0; round < rounds; ++round) {
+        int x = static_cast<int>(gen() % range);
+        // Long runs of inserts and of erases, so nodes fill up and drain.
+        if ((round / 500) % 3 != 2) {
+            auto r = st.insert(x);
+            ASSERT_EQ(r.second, expected.insert(x).second);
+            ASSERT_EQ(*r.first, x);
+            if (std::next(r.first) != st.end()) {
+                ASSERT_EQ(*std::next(r.first), *std::next(expected.find(x)));
+            }
+        } else {
+            ASSERT_EQ(st.erase(x), expected.erase(x));
+        }
+        ASSERT_EQ(st.size(), expected.size());
+        if (round % 250 == 0) versions.push_back({st, expected});
+    }
+    versions.push_back({st, expected});
+
+    for (auto const& v : versions) {
+        Set const& s = v.first;
+        ASSERT_TRUE(std::equal(s.begin(), s.end(), v.second.begin(), v.second.end()));
+        ASSERT_EQ(s.size(), v.second.size());
+        ASSERT_EQ(s.empty(), v.second.empty());
+        std::vector<int> back;
+        for (auto it = s.end(); it != s.begin(); ) back.push_back(*--it);
+        ASSERT_TRUE(std::equal(back.begin(), back.end(), v.second.rbegin(), v.second.rend()));
+        for (int k = -1; k <= range; k += 7) {
+            ASSERT_EQ(s.contains(k), v.second.count(k) == 1);
+            ASSERT_EQ(s.find(k) != s.end(), v.second.count(k) == 1);
+            auto lb = s.lower_bound(k);
+            auto elb = v.second.lower_bound(k);
+            ASSERT_EQ(lb == s.end(), elb == v.second.end());
+            if (elb != v.second.end()) {
+                ASSERT_EQ(*lb, *elb);
+            }
+            auto ub = s.upper_bound(k);
+            auto eub = v.second.upper_bound(k);
+            ASSERT_EQ(ub == s.end(), eub == v.second.end());
+            if (eub != v.second.end()) {
+                ASSERT_EQ(*ub, *eub);
+                // A bound steps back to the key before it.
+                if (eub != v.second.begin()) {
+                    ASSERT_EQ(*std::prev(ub), *std::prev(eub));
+                }
+            }
+        }
+    }
+
+    for (int x : reference_set(expected)) {
+        st.erase(st.find(x));
+    }
+    EXPECT_TRUE(st.empty());
+    EXPECT_EQ(st.begin(), st.end());
+}
+
+TEST(SharedPtr_BTree, string_keys) {
+    persistent_btree_set<std::string, smart_shared_pointer, default_node_allocator, std::less<>, 6> st;
+    std::set<std::string> expected;
+    std::mt19937 gen(8);
+    for (int i = 0; i < 2000; ++i) {
+        std::string w(1 + gen() % 3, static_cast<char>('a' + gen() % 26));
+        if (gen() % 4) {
+            EXPECT_EQ(st.insert(w).second, expected.insert(w).second);
+        } else {
+            EXPECT_EQ(st.erase(w), expected.erase(w));
+        }
+    }
+    EXPECT_TRUE(std::equal(st.begin(), st.end(), expected.begin(), expected.end()));
+    EXPECT_TRUE(st.contains("aa") == (expected.count("aa") == 1));
+    EXPECT_TRUE((st.find("zz") != st.end()) == (expected.count("zz") == 1));
+}
+
+// Sends every key to one of three hashes, so almost all keys collide.
+struct clumped_hash {
+    std::size_t operator()(int x) const noexcept {
+        return static_cast<std::size_t>(x % 3) * 0x9e3779b97f4a7c15ull;
+    }
+};
+
+// Hash set configurations: three pointer policies, and a hash that sends
+// almost every key into a collision node.
+struct shared_hash_set {
+    using set = persistent_hash_set<int>;
+
+    static std::string name() {
+        return "SharedPtr";
+    }
+};
+
+struct linked_hash_set {
+    using set = persistent_hash_set<int, smart_linked_pointer>;
+
+    static std::string name() {
+        return "SmartLinkedPtr";
+    }
+};
+
+struct pooled_hash_set {
+    using set = persistent_hash_set<int, smart_intrusive_pointer, pool_node_allocator>;
+
+    static std::string name() {
+        return "IntrusivePtr_Pooled";
+    }
+};
+
+struct colliding_hash_set {
+    using set = persistent_hash_set<int, smart_shared_pointer, default_node_allocator, clumped_hash>;
+
+    static std::string name() {
+        return "SharedPtr_FullCollisions";
+    }
+};
+
+template <typename Config>
+using Hash = config_test<Config>;
+
+using hash_configs = ::testing::Types<shared_hash_set, linked_hash_set, pooled_hash_set, colliding_hash_set>;
+TYPED_TEST_SUITE(Hash, hash_configs, config_name);
+
+TYPED_TEST(Hash, against_unordered_set) {
+    using Set = typename TestFixture::set;
+    int const rounds = 4000, range = 2000;
+    std::mt19937 gen(4242);
+    Set st;
+    std::unordered_set<int> expected;
+    std::vector<std::pair<Set, std::unordered_set<int>>> versions;
+    for (int round = 0; round < rounds; ++round) {
+        int x = static_cast<int>(gen() % range);
+        if ((round / 400) % 3 != 2) {
+            auto r = st.insert(x);
+            ASSERT_EQ(r.second, expected.insert(x).second);
+            ASSERT_EQ(*r.first, x);
+        } else {
+            ASSERT_EQ(st.erase(x), expected.erase(x));
+        }
+        ASSERT_EQ(st.size(), expected.size());
+        if (round % 250 == 0) versions.push_back({st, expected});
+    }
+    versions.push_back({st, expected});
+
+    for (auto const& v : versions) {
+        Set const& s = v.first;
+        std::vector<int> seen(s.begin(), s.end());
+        ASSERT_EQ(seen.size(), v.second.size());
+        ASSERT_EQ(std::unordered_set<int>(seen.begin(), seen.end()), v.second);
+        for (int k = -1; k <= range; k += 5) {
+            ASSERT_EQ(s.contains(k), v.second.count(k) == 1);
+            auto it = s.find(k);
+            ASSERT_EQ(it != s.end(), v.second.count(k) == 1);
+            if (it != s.end()) {
+                ASSERT_EQ(*it, k);
+            }
+        }
+        // find lands where iteration reaches the same key, and iteration
+        // from a found key reaches the end after the rest, checked on a
+        // few keys per version.
+        std::size_t i = 0;
+        for (auto it = s.begin(); it != s.end(); ++it, ++i) {
+            ASSERT_TRUE(s.find(*it) == it);
+        }
+        for (i = 0; i < seen.size(); i += seen.size() / 8 + 1) {
+            std::size_t after = 0;
+            for (auto it = s.find(seen[i]); it != s.end(); ++it) ++after;
+            ASSERT_EQ(after, seen.size() - i);
+        }
+    }
+
+    std::vector<int> all(st.begin(), st.end());
+    for (int x : all) st.erase(st.find(x));
+    EXPECT_TRUE(st.empty());
+    EXPECT_EQ(st.size(), 0u);
+    EXPECT_EQ(st.begin(), st.end());
+}
+
+TEST(SharedPtr_Hash, string_keys_and_sharing) {
+    persistent_hash_set<std::string> a;
+    for (int i = 0; i < 1000; ++i) a.insert("key" + std::to_string(i));
+    persistent_hash_set<std::string> b = a;
+    EXPECT_TRUE(b.erase("key7"));
+    EXPECT_FALSE(b.erase("key7"));
+    EXPECT_TRUE(b.insert("other").second);
+    EXPECT_FALSE(b.insert(std::string("key8")).second);
+    EXPECT_TRUE(a.contains("key7"));
+    EXPECT_FALSE(a.contains("other"));
+    EXPECT_EQ(a.size(), 1000u);
+    EXPECT_EQ(b.size(), 1000u);
+    EXPECT_FALSE(b.contains("key7"));
+    EXPECT_TRUE(b.contains("other"));
+}
+
+static std::string snapshot_path(char const* name) {
+    return testing::TempDir() + "persistent_set_" + name + ".snap";
+}
+
+TEST(SharedPtr_Snapshot, mapped_reads_and_promotion) {
+    using set = persistent_set<int>;
+    std::mt19937 gen(606);
+    set st;
+    std::set<int> expected;
+    for (int i = 0; i < 20000; ++i) {
+        int x = static_cast<int>(gen() % 100000) - 50000;
+        st.insert(x);
+        expected.insert(x);
+    }
+    std::string path = snapshot_path("mapped");
+    save_snapshot(st, path);
+
+    snapshot_view<int> view(path);
+    EXPECT_EQ(view.size(), expected.size());
+    EXPECT_TRUE(std::equal(view.begin(), view.end(), expected.begin(), expected.end()));
+    for (int k = -50010; k < 50010; k += 37) {
+        ASSERT_EQ(view.contains(k), expected.count(k) == 1);
+        ASSERT_EQ(view.rank(k), st.rank(k));
+        auto e = expected.upper_bound(k);
+        ASSERT_EQ(view.upper_bound(k) == view.end(), e == expected.end());
+        if (e != expected.end()) {
+            ASSERT_EQ(*view.upper_bound(k), *e);
+        }
+    }
+
+    snapshot_set<set> loaded = load_snapshot<set>(path);
+    EXPECT_TRUE(loaded.mapped());
+    EXPECT_EQ(loaded.size(), expected.size());
+    int present = *expected.begin();
+    EXPECT_FALSE(loaded.insert(present));
+    EXPECT_EQ(loaded.erase(50001), 0u);
+    EXPECT_TRUE(loaded.mapped());
+
+    EXPECT_TRUE(loaded.insert(50001));
+    EXPECT_FALSE(loaded.mapped());
+    EXPECT_EQ(loaded.erase(present), 1u);
+    expected.insert(50001);
+    expected.erase(present);
+    std::vector<int> got;
+    loaded.for_each([&got](int x) { got.push_back(x); });
+    EXPECT_TRUE(std::equal(got.begin(), got.end(), expected.begin(), expected.end()));
+    set promoted = loaded.persistent();
+    EXPECT_EQ(promoted.size(), expected.size());
+    EXPECT_TRUE(promoted.contains(50001));
+
+    // The file still holds the version that was saved.
+    snapshot_view<int> again(path);
+    EXPECT_TRUE(std::equal(again.begin(), again.end(), st.begin(), st.end()));
+    std::remove(path.c_str());
+}
+
+struct point {
+    int x, y;
+
+    bool operator < (point const& other) const {
+        return x != other.x ? x < other.x : y < other.y;
+    }
+};
+
+TEST(IntrusivePtr_Snapshot, struct_keys_and_btree_source) {
+    persistent_btree_set<point, smart_shared_pointer, default_node_allocator, std::less<point>, 8> src;
+    for (int i = 0; i < 500; ++i) src.insert(point{i % 17, i});
+    std::string path = snapshot_path("points");
+    save_snapshot(src, path);
+
+    snapshot_set<persistent_set<point, smart_intrusive_pointer>> loaded(path);
+    EXPECT_EQ(loaded.size(), 500u);
+    EXPECT_TRUE(loaded.contains(point{3, 3}));
+    EXPECT_FALSE(loaded.contains(point{3, 4}));
+    EXPECT_TRUE(loaded.erase(point{3, 3}));
+    EXPECT_FALSE(loaded.mapped());
+    EXPECT_EQ(loaded.persistent().size(), 499u);
+
+    // Promoted ahead of any edit.
+    snapshot_set<persistent_set<point, smart_intrusive_pointer>> eager(path);
+    eager.promote();
+    EXPECT_FALSE(eager.mapped());
+    EXPECT_EQ(eager.size(), 500u);
+    EXPECT_TRUE(eager.contains(point{3, 3}));
+    eager.promote();
+    EXPECT_EQ(eager.persistent().size(), 500u);
+    std::remove(path.c_str());
+}
+
+TEST(SharedPtr_Snapshot, empty_and_foreign_files) {
+    std::string path = snapshot_path("empty");
+    save_snapshot(persistent_set<long long>(), path);
+    snapshot_set<persistent_set<long long>> loaded(path);
+    EXPECT_TRUE(loaded.empty());
+    EXPECT_FALSE(loaded.contains(1));
+    EXPECT_TRUE(loaded.insert(1));
+    EXPECT_EQ(loaded.size(), 1u);
+
+    // Keys of another size, a truncated file, no file at all.
+    EXPECT_THROW(snapshot_view<int>{path}, std::runtime_error);
+    persistent_set<long long> one;
+    one.insert(7);
+    save_snapshot(one, path);
+    EXPECT_EQ(snapshot_view<long long>(path).size(), 1u);
+    EXPECT_EQ(truncate(path.c_str(), snapshot_header::keys_offset + 4), 0);
+    EXPECT_THROW(snapshot_view<long long>{path}, std::runtime_error);
+    std::remove(path.c_str());
+    EXPECT_THROW(snapshot_view<long long>{path}, std::runtime_error);
+    EXPECT_THROW(save_snapshot(one, testing::TempDir() + "persistent_set_missing/one.snap"), std::runtime_error);
+}
+
 template struct smart_linked_pointer<std::string>;
 template struct smart_linked_pointer<int>;
 
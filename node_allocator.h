@@ -0,0 +1,252 @@
+#ifndef NODE_ALLOCATOR_H
+#define NODE_ALLOCATOR_H
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+
+// Allocator policies for persistent_set nodes. A policy is a class with
+//     static void* allocate(std::size_t size);
+//     static void deallocate(void* p, std::size_t size) noexcept;
+// Nodes route their operator new/delete through it, so every scoped_ptr
+// policy (and std::shared_ptr) picks it up without knowing about it.
+
+struct default_node_allocator
+{
+    static void* allocate(std::size_t size) {
+        return ::operator new(size);
+    }
+
+    static void deallocate(void* p, std::size_t) noexcept {
+        ::operator delete(p);
+    }
+};
+
+// Size-class slabs with per-thread free lists. Freed nodes go back to the
+// list of the thread that frees them and are handed out again without
+// touching malloc. A thread keeps at most max_cached blocks per class and
+// passes the excess to a shared depot in batches, so memory freed by a
+// consumer thread flows back to the producer instead of piling up. Slabs
+// are kept for the lifetime of the process; free lists of finished threads
+// are moved to the depot too.
+struct pool_node_allocator
+{
+    struct statistics {
+        std::size_t allocations {};
+        std::size_t deallocations {};
+        std::size_t slabs {};
+        std::size_t bytes_reserved {};
+
+        std::size_t in_use() const noexcept {
+            return allocations - deallocations;
+        }
+    };
+
+    static void* allocate(std::size_t size) {
+        if (size > max_size) return ::operator new(size);
+        cache& c = local();
+        std::size_t cls = size_class(size);
+        if (!c.heads[cls]) return allocate_slow(c, cls);
+        bump(c.allocations);
+        free_block* b = c.heads[cls];
+        c.heads[cls] = b->next;
+        --c.lengths[cls];
+        return b;
+    }
+
+    static void deallocate(void* p, std::size_t size) noexcept {
+        if (size > max_size) {
+            ::operator delete(p);
+            return;
+        }
+        cache& c = local();
+        std::size_t cls = size_class(size);
+        free_block* b = static_cast<free_block*>(p);
+        if (!c.registered) enroll(c);
+        if (c.finished) {
+            std::lock_guard<std::mutex> lock(shared().mutex);
+            ++shared().totals.deallocations;
+            b->next = shared().heads[cls];
+            shared().heads[cls] = b;
+            return;
+        }
+        bump(c.deallocations);
+        b->next = c.heads[cls];
+        c.heads[cls] = b;
+        if (++c.lengths[cls] > max_cached) spill(c, cls);
+    }
+
+    // Counters over every thread that has used the pool, running or
+    // finished. Blocks freed by another thread than the one that made
+    // them still balance out in in_use().
+    static statistics stats() noexcept {
+        depot& d = shared();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        statistics total = d.totals;
+        for (cache* c = d.live; c; c = c->next) {
+            total.allocations += c->allocations.load(std::memory_order_relaxed);
+            total.deallocations += c->deallocations.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+private:
+
+    static constexpr std::size_t granularity = 16;
+    static constexpr std::size_t max_size = 256;
+    static constexpr std::size_t classes = max_size / granularity;
+    static constexpr std::size_t blocks_per_slab = 64;
+
+    // Blocks per class a thread keeps before handing a batch of
+    // blocks_per_slab to the depot; the depot hands them out in batches of
+    // the same size.
+    static constexpr std::size_t max_cached = 2 * blocks_per_slab;
+
+    struct free_block {
+        free_block* next;
+    };
+
+    struct slab_header {
+        slab_header* next;
+        alignas(std::max_align_t) unsigned char data[1];
+    };
+
+    // Plain data, so it is usable for the whole life of the thread, even
+    // while other thread_local objects are being destroyed. The counters
+    // are only written by the owning thread; stats() reads them from
+    // others, hence relaxed atomics.
+    struct cache {
+        free_block* heads[classes];
+        std::size_t lengths[classes];
+        std::atomic<std::size_t> allocations;
+        std::atomic<std::size_t> deallocations;
+        cache* next;
+        bool registered;
+        bool finished;
+    };
+
+    // Shared free lists and slabs, the caches of running threads, and
+    // totals: the slab counts and the counters of finished threads. All
+    // guarded by mutex.
+    struct depot {
+        std::mutex mutex;
+        free_block* heads[classes] {};
+        slab_header* slabs {};
+        cache* live {};
+        statistics totals;
+    };
+
+    struct flusher {
+        ~flusher() {
+            cache& c = local();
+            depot& d = shared();
+            std::lock_guard<std::mutex> lock(d.mutex);
+            for (std::size_t cls = 0; cls < classes; ++cls) {
+                while (free_block* b = c.heads[cls]) {
+                    c.heads[cls] = b->next;
+                    b->next = d.heads[cls];
+                    d.heads[cls] = b;
+                }
+                c.lengths[cls] = 0;
+            }
+            d.totals.allocations += c.allocations.load(std::memory_order_relaxed);
+            d.totals.deallocations += c.deallocations.load(std::memory_order_relaxed);
+            for (cache** link = &d.live; *link; link = &(*link)->next) {
+                if (*link == &c) {
+                    *link = c.next;
+                    break;
+                }
+            }
+            c.finished = true;
+        }
+    };
+
+    static std::size_t size_class(std::size_t size) noexcept {
+        return size ? (size - 1) / granularity : 0;
+    }
+
+    static cache& local() noexcept {
+        static thread_local cache c {};
+        return c;
+    }
+
+    static depot& shared() noexcept {
+        static depot d;
+        return d;
+    }
+
+    static void bump(std::atomic<std::size_t>& counter) noexcept {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // Makes the calling thread visible to stats() and arranges for its
+    // free lists to go to the depot when it finishes.
+    static void enroll(cache& c) noexcept {
+        static thread_local flusher f;
+        (void)f;
+        std::lock_guard<std::mutex> lock(shared().mutex);
+        c.next = shared().live;
+        shared().live = &c;
+        c.registered = true;
+    }
+
+    static void* allocate_slow(cache& c, std::size_t cls) {
+        if (!c.registered) enroll(c);
+        depot& d = shared();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        if (!d.heads[cls]) carve(d, cls);
+        if (c.finished) {
+            // Nothing may stay on the lists of a finished thread.
+            ++d.totals.allocations;
+            free_block* b = d.heads[cls];
+            d.heads[cls] = b->next;
+            return b;
+        }
+        free_block* first = d.heads[cls];
+        free_block* last = first;
+        std::size_t taken = 1;
+        while (last->next && taken < blocks_per_slab) {
+            last = last->next;
+            ++taken;
+        }
+        d.heads[cls] = last->next;
+        last->next = nullptr;
+        bump(c.allocations);
+        c.heads[cls] = first->next;
+        c.lengths[cls] = taken - 1;
+        return first;
+    }
+
+    // Moves blocks_per_slab blocks from the front of the calling thread's
+    // list to the depot. The batch is cut outside the lock.
+    static void spill(cache& c, std::size_t cls) noexcept {
+        free_block* first = c.heads[cls];
+        free_block* last = first;
+        for (std::size_t i = 1; i < blocks_per_slab; ++i) last = last->next;
+        c.heads[cls] = last->next;
+        c.lengths[cls] -= blocks_per_slab;
+        depot& d = shared();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        last->next = d.heads[cls];
+        d.heads[cls] = first;
+    }
+
+    // Adds a new slab of class cls to the depot. Called with the lock held.
+    static void carve(depot& d, std::size_t cls) {
+        std::size_t block = (cls + 1) * granularity;
+        std::size_t bytes = offsetof(slab_header, data) + block * blocks_per_slab;
+        slab_header* s = static_cast<slab_header*>(::operator new(bytes));
+        s->next = d.slabs;
+        d.slabs = s;
+        ++d.totals.slabs;
+        d.totals.bytes_reserved += bytes;
+        for (std::size_t i = blocks_per_slab; i-- > 0; ) {
+            free_block* b = reinterpret_cast<free_block*>(s->data + i * block);
+            b->next = d.heads[cls];
+            d.heads[cls] = b;
+        }
+    }
+};
+
+#endif // NODE_ALLOCATOR_H
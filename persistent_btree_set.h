@@ -0,0 +1,623 @@
+#ifndef PERSISTENT_BTREE_SET_H
+#define PERSISTENT_BTREE_SET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include "node_allocator.h"
+#include "pointer_traits.h"
+#include "smart_shared_pointer.h"
+#include "small_stack.h"
+
+// Persistent B+-tree: the same set interface as persistent_set over wide
+// nodes. Leaves hold up to width keys, inner nodes up to width children,
+// so a lookup touches log_{width/2}(n) nodes instead of about log2(n), and
+// an edit copies that many nodes of a few cache lines each instead of as
+// many single-key nodes. Keys are copied along with every node on an edit
+// path, which suits small keys such as integers; large keys are better
+// off in persistent_set, which shares them between path copies.
+//
+// Nodes hold fixed arrays of keys, so T must be default constructible.
+// Nodes are never changed once published, so versions can be shared
+// between threads whenever the pointer policy allows it.
+template <typename T, template<typename> class scoped_ptr = smart_shared_pointer,
+          typename allocator = default_node_allocator, typename Compare = std::less<T>,
+          std::size_t width = 32>
+struct persistent_btree_set
+{
+    static_assert(width >= 4 && width <= 1024, "persistent_btree_set: width must be within [4, 1024]");
+    static_assert(std::is_default_constructible<T>::value,
+                  "persistent_btree_set: keys must be default constructible");
+
+    using value_type = T;
+    using key_compare = Compare;
+    struct iterator;
+
+    persistent_btree_set() {}
+
+    persistent_btree_set(persistent_btree_set const& other) noexcept
+        : root(other.root), total(other.total) {}
+
+    persistent_btree_set(persistent_btree_set&& other) noexcept
+        : root(std::move(other.root)), total(other.total) {
+        other.root = nullptr;
+        other.total = 0;
+    }
+
+    ~persistent_btree_set() noexcept {}
+
+    persistent_btree_set& operator=(persistent_btree_set const& other) noexcept {
+        root = other.root;
+        total = other.total;
+        return *this;
+    }
+
+    persistent_btree_set& operator=(persistent_btree_set&& other) noexcept {
+        root = std::move(other.root);
+        total = other.total;
+        other.root = nullptr;
+        other.total = 0;
+        return *this;
+    }
+
+    void swap(persistent_btree_set& other) {
+        using std::swap;
+        swap(root, other.root);
+        swap(total, other.total);
+    }
+
+    iterator find(value_type const& value) const {
+        return find_key(value);
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(K const& key) const {
+        return find_key(key);
+    }
+
+    // First key not less than value.
+    iterator lower_bound(value_type const& value) const {
+        iterator it(root);
+        it.template seek_bound<false>(value);
+        return it;
+    }
+
+    // First key greater than value.
+    iterator upper_bound(value_type const& value) const {
+        iterator it(root);
+        it.template seek_bound<true>(value);
+        return it;
+    }
+
+    bool contains(value_type const& value) const {
+        return lookup(value);
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    bool contains(K const& key) const {
+        return lookup(key);
+    }
+
+    std::size_t count(value_type const& value) const {
+        return contains(value) ? 1 : 0;
+    }
+
+    std::size_t size() const noexcept {
+        return total;
+    }
+
+    bool empty() const noexcept {
+        return !root;
+    }
+
+    iterator begin() const {
+        iterator it(root);
+        it.descend_left(raw(root));
+        return it;
+    }
+
+    iterator end() const {
+        return iterator(root);
+    }
+
+    key_compare key_comp() const {
+        return Compare();
+    }
+
+    std::pair<iterator, bool> insert(value_type const& value) {
+        return put(value);
+    }
+
+    std::pair<iterator, bool> insert(value_type&& value) {
+        return put(std::move(value));
+    }
+
+    void erase(iterator it) {
+        erase(*it);
+    }
+
+    std::size_t erase(value_type const& value) {
+        if (!root) return 0;
+        bool removed = false;
+        replacement top = erase_from(raw(root), value, removed);
+        if (!removed) return 0;
+        node const* n = raw(top.first);
+        if (n->leaf && n->count == 0)
+            top.first = nullptr;
+        else if (!n->leaf && n->count == 1)
+            top.first = link(as_inner(n)->children[0]);
+        root = std::move(top.first);
+        --total;
+        return 1;
+    }
+
+private:
+
+    // count is the number of keys of a leaf or of children of an inner node.
+    struct node : pointer_traits<scoped_ptr>::node_base {
+        std::uint16_t count {0};
+        bool leaf;
+
+        explicit node(bool leaf) noexcept : leaf(leaf) {}
+
+        virtual ~node() = default;
+
+        static void* operator new(std::size_t size) {
+            return allocator::allocate(size);
+        }
+
+        static void operator delete(void* p, std::size_t size) noexcept {
+            allocator::deallocate(p, size);
+        }
+    };
+
+    struct leaf_node : node {
+        T keys[width];
+
+        leaf_node() : node(true) {}
+    };
+
+    // keys[i] separates children[i] from children[i + 1]: it is not below
+    // any key of children[i] and not above any key of children[i + 1].
+    struct inner_node : node {
+        T keys[width - 1];
+        scoped_ptr<node> children[width];
+
+        inner_node() : node(false) {}
+    };
+
+    using link = scoped_ptr<node>;
+
+    // What an edit leaves in place of a node: first alone, or, when it grew
+    // too wide, first and second split at separator. first is empty when
+    // the edit changed nothing.
+    struct replacement {
+        link first;
+        link second;
+        T separator {};
+    };
+
+    // Leaves and inner nodes other than the root keep at least this many
+    // keys and children.
+    static constexpr std::size_t min_fill = width / 2;
+
+    // Root-to-leaf paths up to this depth are kept on the stack, enough for
+    // width 4 and 2^16 keys, or width 32 and far more than fits in memory.
+    static constexpr std::size_t inline_depth = 16;
+
+    link root {nullptr};
+    std::size_t total {0};
+
+    static node const* raw(link const& p) noexcept {
+        return p ? &*p : nullptr;
+    }
+
+    static leaf_node const* as_leaf(node const* n) noexcept {
+        return static_cast<leaf_node const*>(n);
+    }
+
+    static inner_node const* as_inner(node const* n) noexcept {
+        return static_cast<inner_node const*>(n);
+    }
+
+    template <typename A, typename B>
+    static bool less(A const& a, B const& b) {
+        return Compare()(a, b);
+    }
+
+    // Whether key goes before k: it is less than k, or with upper set, not
+    // greater than it.
+    template <bool upper, typename K>
+    static bool before(T const& key, K const& k) {
+        return upper ? !less(k, key) : less(key, k);
+    }
+
+    // Arithmetic keys under the default order are counted in one pass over
+    // the node with no branch on the data. Whether that becomes vector
+    // compares is up to the compiler: the omp simd mark only applies under
+    // OpenMP, or with -fopenmp-simd and PERSISTENT_SET_OPENMP_SIMD defined,
+    // which this repo's own targets set but the installed target does not
+    // pass on. Without them it is a plain loop that the auto-vectorizer
+    // typically handles at -O3 but not at -O2. Anything else takes a
+    // branchless binary search.
+    using counts_keys = std::integral_constant<bool,
+        std::is_arithmetic<T>::value &&
+        (std::is_same<Compare, std::less<T>>::value || std::is_same<Compare, std::less<>>::value)>;
+
+    // Number of keys among keys[0, n) that go before k.
+    template <bool upper, typename K>
+    static std::size_t position(T const* keys, std::size_t n, K const& k) {
+        return position<upper>(keys, n, k, counts_keys());
+    }
+
+    template <bool upper, typename K>
+    static std::size_t position(T const* keys, std::size_t n, K const& k, std::true_type) {
+        std::size_t r = 0;
+#if defined(_OPENMP) || defined(PERSISTENT_SET_OPENMP_SIMD)
+#pragma omp simd reduction(+:r)
+#endif
+        for (std::size_t i = 0; i < n; ++i) r += before<upper>(keys[i], k);
+        return r;
+    }
+
+    template <bool upper, typename K>
+    static std::size_t position(T const* keys, std::size_t n, K const& k, std::false_type) {
+        if (n == 0) return 0;
+        T const* base = keys;
+        while (n > 1) {
+            std::size_t half = n / 2;
+            base = before<upper>(base[half], k) ? base + half : base;
+            n -= half;
+        }
+        return static_cast<std::size_t>(base - keys) + before<upper>(*base, k);
+    }
+
+    // Child of an inner node that holds the keys around k.
+    template <typename K>
+    static std::size_t route(inner_node const* in, K const& k) {
+        return position<true>(in->keys, in->count - 1u, k);
+    }
+
+    template <typename K>
+    bool lookup(K const& k) const {
+        node const* cur = raw(root);
+        if (!cur) return false;
+        while (!cur->leaf) {
+            inner_node const* in = as_inner(cur);
+            cur = raw(in->children[route(in, k)]);
+        }
+        leaf_node const* l = as_leaf(cur);
+        std::size_t pos = position<false>(l->keys, l->count, k);
+        return pos < l->count && !less(k, l->keys[pos]);
+    }
+
+    template <typename K>
+    iterator find_key(K const& k) const {
+        iterator it(root);
+        it.template seek_bound<false>(k);
+        if (it.at && less(k, *it)) return end();
+        return it;
+    }
+
+    // The keys and children below are moved out of the buffers they are
+    // given; the nodes they make are not shared yet.
+
+    static link make_leaf(T* keys, std::size_t n) {
+        leaf_node* l = new leaf_node;
+        link result(l);
+        for (std::size_t i = 0; i < n; ++i) l->keys[i] = std::move(keys[i]);
+        l->count = static_cast<std::uint16_t>(n);
+        return result;
+    }
+
+    // Inner node over children[0, n) separated by keys[0, n - 1).
+    static link make_inner(T* keys, link* children, std::size_t n) {
+        inner_node* in = new inner_node;
+        link result(in);
+        for (std::size_t i = 0; i + 1 < n; ++i) in->keys[i] = std::move(keys[i]);
+        for (std::size_t i = 0; i < n; ++i) in->children[i] = std::move(children[i]);
+        in->count = static_cast<std::uint16_t>(n);
+        return result;
+    }
+
+    // One leaf of keys[0, n), or two halves when that is too many.
+    static replacement settle_leaf(T* keys, std::size_t n) {
+        replacement result;
+        if (n <= width) {
+            result.first = make_leaf(keys, n);
+            return result;
+        }
+        std::size_t half = n / 2;
+        result.separator = keys[half];
+        result.first = make_leaf(keys, half);
+        result.second = make_leaf(keys + half, n - half);
+        return result;
+    }
+
+    // The same for children[0, n); the key between the halves moves up.
+    static replacement settle_inner(T* keys, link* children, std::size_t n) {
+        replacement result;
+        if (n <= width) {
+            result.first = make_inner(keys, children, n);
+            return result;
+        }
+        std::size_t half = n / 2;
+        result.separator = std::move(keys[half - 1]);
+        result.first = make_inner(keys, children, half);
+        result.second = make_inner(keys + half, children + half, n - half);
+        return result;
+    }
+
+    // Copy of in with children [from, to) replaced by kids[0, n), separated
+    // by seps[0, n - 1). The keys bounding the run stay where they are.
+    static replacement splice(inner_node const* in, std::size_t from, std::size_t to,
+                              link* kids, T* seps, std::size_t n) {
+        T keys[width];
+        link children[width + 1];
+        std::size_t c = 0, q = 0;
+        for (std::size_t i = 0; i < from; ++i) children[c++] = link(in->children[i]);
+        for (std::size_t i = 0; i < n; ++i) children[c++] = std::move(kids[i]);
+        for (std::size_t i = to; i < in->count; ++i) children[c++] = link(in->children[i]);
+        for (std::size_t i = 0; i < from; ++i) keys[q++] = in->keys[i];
+        for (std::size_t i = 0; i + 1 < n; ++i) keys[q++] = std::move(seps[i]);
+        for (std::size_t i = to - 1; i + 1 < in->count; ++i) keys[q++] = in->keys[i];
+        return settle_inner(keys, children, c);
+    }
+
+    template <typename K>
+    std::pair<iterator, bool> put(K&& k) {
+        if (!root) {
+            leaf_node* l = new leaf_node;
+            link fresh(l);
+            l->keys[0] = std::forward<K>(k);
+            l->count = 1;
+            root = std::move(fresh);
+            total = 1;
+            return {iterator(root, l, 0), true};
+        }
+        leaf_node const* at = nullptr;
+        std::size_t pos = 0;
+        replacement top = insert_into(raw(root), std::forward<K>(k), at, pos);
+        if (!top.first) return {iterator(root, at, pos), false};
+        if (top.second) {
+            link kids[2] = {std::move(top.first), std::move(top.second)};
+            root = make_inner(&top.separator, kids, 2);
+        } else {
+            root = std::move(top.first);
+        }
+        ++total;
+        return {iterator(root, at, pos), true};
+    }
+
+    // Inserts k below n. at and pos are left at the key equivalent to k,
+    // whether it was there already or has just been added.
+    template <typename K>
+    static replacement insert_into(node const* n, K&& k, leaf_node const*& at, std::size_t& pos) {
+        if (n->leaf) return insert_leaf(as_leaf(n), std::forward<K>(k), at, pos);
+        inner_node const* in = as_inner(n);
+        std::size_t i = route(in, k);
+        replacement sub = insert_into(raw(in->children[i]), std::forward<K>(k), at, pos);
+        if (!sub.first) return sub;
+        link kids[2] = {std::move(sub.first), std::move(sub.second)};
+        return splice(in, i, i + 1, kids, &sub.separator, kids[1] ? 2 : 1);
+    }
+
+    template <typename K>
+    static replacement insert_leaf(leaf_node const* l, K&& k, leaf_node const*& at, std::size_t& pos) {
+        std::size_t p = position<false>(l->keys, l->count, k);
+        if (p < l->count && !less(k, l->keys[p])) {
+            at = l;
+            pos = p;
+            return {};
+        }
+        T keys[width + 1];
+        std::size_t n = l->count;
+        for (std::size_t i = 0; i < p; ++i) keys[i] = l->keys[i];
+        keys[p] = std::forward<K>(k);
+        for (std::size_t i = p; i < n; ++i) keys[i + 1] = l->keys[i];
+        replacement result = settle_leaf(keys, n + 1);
+        if (result.second && p >= (n + 1) / 2) {
+            at = as_leaf(raw(result.second));
+            pos = p - (n + 1) / 2;
+        } else {
+            at = as_leaf(raw(result.first));
+            pos = p;
+        }
+        return result;
+    }
+
+    // Removes k from below n. The returned node may be short of min_fill;
+    // its parent makes up for that with a sibling.
+    template <typename K>
+    static replacement erase_from(node const* n, K const& k, bool& removed) {
+        if (n->leaf) {
+            leaf_node const* l = as_leaf(n);
+            std::size_t p = position<false>(l->keys, l->count, k);
+            if (p == l->count || less(k, l->keys[p])) return {};
+            removed = true;
+            T keys[width];
+            std::size_t c = 0;
+            for (std::size_t i = 0; i < l->count; ++i) {
+                if (i != p) keys[c++] = l->keys[i];
+            }
+            return settle_leaf(keys, c);
+        }
+        inner_node const* in = as_inner(n);
+        std::size_t i = route(in, k);
+        replacement sub = erase_from(raw(in->children[i]), k, removed);
+        if (!removed) return {};
+        if (sub.first->count >= min_fill) return splice(in, i, i + 1, &sub.first, nullptr, 1);
+
+        // Pool the short child with a neighbour, then split them evenly
+        // again if they do not fit in one node.
+        std::size_t s = i > 0 ? i - 1 : i;
+        node const* left = s == i ? raw(sub.first) : raw(in->children[s]);
+        node const* right = s == i ? raw(in->children[i + 1]) : raw(sub.first);
+        replacement pooled;
+        if (left->leaf) {
+            T keys[2 * width];
+            std::size_t c = 0;
+            for (std::size_t j = 0; j < left->count; ++j) keys[c++] = as_leaf(left)->keys[j];
+            for (std::size_t j = 0; j < right->count; ++j) keys[c++] = as_leaf(right)->keys[j];
+            pooled = settle_leaf(keys, c);
+        } else {
+            T keys[2 * width];
+            link children[2 * width];
+            std::size_t c = 0, q = 0;
+            for (std::size_t j = 0; j + 1 < left->count; ++j) keys[q++] = as_inner(left)->keys[j];
+            keys[q++] = in->keys[s];
+            for (std::size_t j = 0; j + 1 < right->count; ++j) keys[q++] = as_inner(right)->keys[j];
+            for (std::size_t j = 0; j < left->count; ++j) children[c++] = link(as_inner(left)->children[j]);
+            for (std::size_t j = 0; j < right->count; ++j) children[c++] = link(as_inner(right)->children[j]);
+            pooled = settle_inner(keys, children, c);
+        }
+        link kids[2] = {std::move(pooled.first), std::move(pooled.second)};
+        return splice(in, s, s + 2, kids, &pooled.separator, kids[1] ? 2 : 1);
+    }
+};
+
+template <typename T, template<typename> class scoped_ptr, typename allocator, typename Compare,
+          std::size_t width>
+struct persistent_btree_set<T, scoped_ptr, allocator, Compare, width>::iterator
+{
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T const*;
+    using reference = T const&;
+
+    value_type const& operator*() const {
+        return at->keys[pos];
+    }
+
+    value_type const* operator->() const {
+        return &at->keys[pos];
+    }
+
+    iterator& operator++() {
+        attach();
+        if (++pos < at->count) return *this;
+        while (!path.empty() && path.top().second + 1 == path.top().first->count) path.pop();
+        if (path.empty()) {
+            at = nullptr;
+            pos = 0;
+            return *this;
+        }
+        std::size_t i = ++path.top().second;
+        descend_left(raw(path.top().first->children[i]));
+        return *this;
+    }
+
+    iterator operator++(int) {
+        iterator i = *this;
+        ++(*this);
+        return i;
+    }
+
+    iterator& operator--() {
+        attach();
+        if (!at) {
+            descend_right(raw(owner));
+            return *this;
+        }
+        if (pos > 0) {
+            --pos;
+            return *this;
+        }
+        while (path.top().second == 0) path.pop();
+        std::size_t i = --path.top().second;
+        descend_right(raw(path.top().first->children[i]));
+        return *this;
+    }
+
+    iterator operator--(int) {
+        iterator i = *this;
+        --(*this);
+        return i;
+    }
+
+    friend bool operator ==(iterator const& a, iterator const& b) noexcept {
+        return a.owner == b.owner && a.at == b.at && a.pos == b.pos;
+    }
+
+    friend bool operator !=(iterator const& a, iterator const& b) noexcept {
+        return !(a == b);
+    }
+
+private:
+
+    friend struct persistent_btree_set;
+
+    explicit iterator(link const& owner) noexcept
+        : owner(owner) {}
+
+    // Insert and find stop at a leaf slot. The inner path above it is left
+    // empty until the iterator first moves, when attach() descends to the
+    // key again.
+    iterator(link const& owner, leaf_node const* at, std::size_t pos)
+        : owner(owner), at(at), pos(pos), detached(true) {}
+
+    void attach() {
+        if (!detached) return;
+        detached = false;
+        if (at) seek_bound<false>(at->keys[pos]);
+    }
+
+    void descend_left(node const* cur) {
+        if (!cur) return;
+        while (!cur->leaf) {
+            path.push({as_inner(cur), 0});
+            cur = raw(as_inner(cur)->children[0]);
+        }
+        at = as_leaf(cur);
+        pos = 0;
+    }
+
+    void descend_right(node const* cur) {
+        if (!cur) return;
+        while (!cur->leaf) {
+            std::size_t last = cur->count - 1u;
+            path.push({as_inner(cur), last});
+            cur = raw(as_inner(cur)->children[last]);
+        }
+        at = as_leaf(cur);
+        pos = at->count - 1u;
+    }
+
+    // Leaves the iterator at the first key not less than k, or with upper
+    // set, the first key greater than k; at end() when there is none.
+    template <bool upper, typename K>
+    void seek_bound(K const& k) {
+        path.clear();
+        node const* cur = raw(owner);
+        if (!cur) return;
+        while (!cur->leaf) {
+            inner_node const* in = as_inner(cur);
+            std::size_t i = route(in, k);
+            path.push({in, i});
+            cur = raw(in->children[i]);
+        }
+        at = as_leaf(cur);
+        pos = position<upper>(at->keys, at->count, k);
+        if (pos == at->count) {
+            // Past the last key of this leaf: step to the next one.
+            pos = at->count - 1u;
+            ++*this;
+        }
+    }
+
+    // The cursor is slot pos of leaf at. path holds each inner node above
+    // that leaf with the index of the child taken, so stepping off either
+    // end of a leaf climbs to the nearest node with a child left on that
+    // side. The pointers are plain, as in persistent_set's iterator.
+    link owner;
+    small_stack<std::pair<inner_node const*, std::size_t>, inline_depth> path;
+    leaf_node const* at {nullptr};
+    std::size_t pos {0};
+    bool detached {false};
+};
+
+#endif // PERSISTENT_BTREE_SET_H
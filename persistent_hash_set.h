@@ -0,0 +1,594 @@
+#ifndef PERSISTENT_HASH_SET_H
+#define PERSISTENT_HASH_SET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <new>
+#include <utility>
+#include "node_allocator.h"
+#include "pointer_traits.h"
+#include "smart_shared_pointer.h"
+#include "small_stack.h"
+
+// Persistent unordered set: a hash array mapped trie in the compressed
+// CHAMP layout (Steindorfer and Vinju). Each level consumes five bits of
+// the hash. A node has two 32-bit maps, one for slots holding a key and one
+// for slots holding a subtree, and stores exactly as many keys and
+// children as the maps have bits set, right behind its header; the entry
+// of a slot is found by counting the bits below it. A lookup reads about
+// log32(n) nodes and compares one key.
+//
+// Keys whose hashes agree in every bit end up together in a collision node
+// below the last level. Versions share nodes as persistent_set does: an
+// edit copies the nodes on the path to its slot and nothing else, and the
+// trie is kept canonical (a subtree left with a single key moves it up
+// into its parent), so its shape depends only on the keys it holds.
+template <typename T, template<typename> class scoped_ptr = smart_shared_pointer,
+          typename allocator = default_node_allocator, typename Hash = std::hash<T>,
+          typename KeyEqual = std::equal_to<T>>
+struct persistent_hash_set
+{
+    static_assert(alignof(T) <= alignof(std::max_align_t), "persistent_hash_set: over-aligned keys");
+
+    using value_type = T;
+    using hasher = Hash;
+    using key_equal = KeyEqual;
+    struct iterator;
+
+    persistent_hash_set() {}
+
+    persistent_hash_set(persistent_hash_set const& other) noexcept
+        : root(other.root), total(other.total) {}
+
+    persistent_hash_set(persistent_hash_set&& other) noexcept
+        : root(std::move(other.root)), total(other.total) {
+        other.root = nullptr;
+        other.total = 0;
+    }
+
+    ~persistent_hash_set() noexcept {}
+
+    persistent_hash_set& operator=(persistent_hash_set const& other) noexcept {
+        root = other.root;
+        total = other.total;
+        return *this;
+    }
+
+    persistent_hash_set& operator=(persistent_hash_set&& other) noexcept {
+        root = std::move(other.root);
+        total = other.total;
+        other.root = nullptr;
+        other.total = 0;
+        return *this;
+    }
+
+    void swap(persistent_hash_set& other) {
+        using std::swap;
+        swap(root, other.root);
+        swap(total, other.total);
+    }
+
+    iterator find(value_type const& value) const {
+        std::size_t pos = 0;
+        node const* n = locate(value, pos);
+        return n ? iterator(root, n, pos) : end();
+    }
+
+    bool contains(value_type const& value) const {
+        std::size_t pos = 0;
+        return locate(value, pos) != nullptr;
+    }
+
+    std::size_t count(value_type const& value) const {
+        return contains(value) ? 1 : 0;
+    }
+
+    std::size_t size() const noexcept {
+        return total;
+    }
+
+    bool empty() const noexcept {
+        return !root;
+    }
+
+    // Iteration visits the keys of a node, then its subtrees in slot order;
+    // the order is the same for any two sets holding the same keys.
+    iterator begin() const {
+        iterator it(root);
+        if (!root) return it;
+        it.path.push({raw(root), 0});
+        if (root->key_count == 0) it.advance();
+        return it;
+    }
+
+    iterator end() const {
+        return iterator(root);
+    }
+
+    hasher hash_function() const {
+        return Hash();
+    }
+
+    key_equal key_eq() const {
+        return KeyEqual();
+    }
+
+    std::pair<iterator, bool> insert(value_type const& value) {
+        return put(value);
+    }
+
+    std::pair<iterator, bool> insert(value_type&& value) {
+        return put(std::move(value));
+    }
+
+    void erase(iterator it) {
+        erase(*it);
+    }
+
+    std::size_t erase(value_type const& value) {
+        if (!root) return 0;
+        bool removed = false;
+        link top = erase_from(raw(root), value, hash(value), 0, removed);
+        if (!removed) return 0;
+        root = std::move(top);
+        --total;
+        return 1;
+    }
+
+private:
+
+    struct trailing_t {};
+
+    // Header of a node; its children and then its keys follow it in the
+    // same allocation. key_count and child_count count the entries built
+    // so far, which is all of them once the node is published.
+    struct node : pointer_traits<scoped_ptr>::node_base {
+        using child_link = scoped_ptr<node>;
+
+        std::uint32_t datamap;
+        std::uint32_t nodemap;
+        std::uint32_t key_count {0};
+        std::uint32_t child_count {0};
+        std::uint32_t child_capacity;
+
+        node(std::uint32_t datamap, std::uint32_t nodemap, std::uint32_t child_capacity) noexcept
+            : datamap(datamap), nodemap(nodemap), child_capacity(child_capacity) {}
+
+        node(node const&) = delete;
+        node& operator=(node const&) = delete;
+
+        ~node() {
+            for (std::uint32_t i = 0; i < key_count; ++i) keys()[i].~T();
+            for (std::uint32_t i = 0; i < child_count; ++i) children()[i].~child_link();
+        }
+
+        child_link* children() noexcept {
+            return reinterpret_cast<child_link*>(reinterpret_cast<unsigned char*>(this) + children_offset());
+        }
+
+        child_link const* children() const noexcept {
+            return const_cast<node*>(this)->children();
+        }
+
+        T* keys() noexcept {
+            return reinterpret_cast<T*>(reinterpret_cast<unsigned char*>(this) + keys_offset(child_capacity));
+        }
+
+        T const* keys() const noexcept {
+            return const_cast<node*>(this)->keys();
+        }
+
+        template <typename K>
+        void add_key(K&& k) {
+            ::new (static_cast<void*>(keys() + key_count)) T(std::forward<K>(k));
+            ++key_count;
+        }
+
+        void add_child(child_link c) noexcept {
+            ::new (static_cast<void*>(children() + child_count)) child_link(std::move(c));
+            ++child_count;
+        }
+
+        static std::size_t children_offset() noexcept {
+            return round_up(sizeof(node), alignof(child_link));
+        }
+
+        static std::size_t keys_offset(std::size_t children) noexcept {
+            return round_up(children_offset() + children * sizeof(child_link), alignof(T));
+        }
+
+        // The allocation's size is kept in front of the node, so delete
+        // can hand the whole block back to the allocator.
+        static void* operator new(std::size_t size, trailing_t, std::size_t extra) {
+            std::size_t bytes = prefix + size + extra;
+            unsigned char* block = static_cast<unsigned char*>(allocator::allocate(bytes));
+            *reinterpret_cast<std::size_t*>(block) = bytes;
+            return block + prefix;
+        }
+
+        static void operator delete(void* p, trailing_t, std::size_t) noexcept {
+            release(p);
+        }
+
+        static void operator delete(void* p) noexcept {
+            release(p);
+        }
+
+    private:
+
+        static constexpr std::size_t prefix = alignof(std::max_align_t);
+
+        static std::size_t round_up(std::size_t n, std::size_t align) noexcept {
+            return (n + align - 1) / align * align;
+        }
+
+        static void release(void* p) noexcept {
+            unsigned char* block = static_cast<unsigned char*>(p) - prefix;
+            allocator::deallocate(block, *reinterpret_cast<std::size_t*>(block));
+        }
+    };
+
+    using link = scoped_ptr<node>;
+
+    static constexpr unsigned bits = 5;
+    static constexpr std::size_t slot_mask = (std::size_t(1) << bits) - 1;
+    static constexpr unsigned hash_bits = std::numeric_limits<std::size_t>::digits;
+
+    // Deepest path: one node per level of the hash, then a collision node.
+    static constexpr std::size_t max_depth = (hash_bits + bits - 1) / bits + 1;
+
+    link root {nullptr};
+    std::size_t total {0};
+
+    static node const* raw(link const& p) noexcept {
+        return p ? &*p : nullptr;
+    }
+
+    // The hasher and key_equal are stateless, like the comparators of the
+    // ordered sets: fresh ones are made for every call.
+    template <typename K>
+    static std::size_t hash(K const& k) {
+        return Hash()(k);
+    }
+
+    template <typename A, typename B>
+    static bool equal(A const& a, B const& b) {
+        return KeyEqual()(a, b);
+    }
+
+    static std::uint32_t slot_bit(std::size_t h, unsigned shift) noexcept {
+        return std::uint32_t(1) << ((h >> shift) & slot_mask);
+    }
+
+    static unsigned popcount(std::uint32_t x) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+        return static_cast<unsigned>(__builtin_popcount(x));
+#else
+        x = x - ((x >> 1) & 0x55555555u);
+        x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+        return static_cast<unsigned>((((x + (x >> 4)) & 0x0f0f0f0fu) * 0x01010101u) >> 24);
+#endif
+    }
+
+    // Position of the entry for bit among the entries of map.
+    static std::uint32_t index(std::uint32_t map, std::uint32_t bit) noexcept {
+        return popcount(map & (bit - 1));
+    }
+
+    // Empty node with room for the given entries, already owned by hold.
+    static node* make(std::uint32_t datamap, std::uint32_t nodemap, std::size_t keys,
+                      std::size_t children, link& hold) {
+        std::size_t extra = node::keys_offset(children) + keys * sizeof(T) - sizeof(node);
+        node* n = new (trailing_t(), extra) node(datamap, nodemap, static_cast<std::uint32_t>(children));
+        hold = link(n);
+        return n;
+    }
+
+    // Node holding k and nothing else that was found on the way down, if
+    // any, with its position there.
+    template <typename K>
+    node const* locate(K const& k, std::size_t& pos) const {
+        std::size_t h = hash(k);
+        node const* n = raw(root);
+        for (unsigned shift = 0; n; shift += bits) {
+            if (shift >= hash_bits) {
+                for (pos = 0; pos < n->key_count; ++pos) {
+                    if (equal(n->keys()[pos], k)) return n;
+                }
+                return nullptr;
+            }
+            std::uint32_t bit = slot_bit(h, shift);
+            if (n->datamap & bit) {
+                pos = index(n->datamap, bit);
+                return equal(n->keys()[pos], k) ? n : nullptr;
+            }
+            if (!(n->nodemap & bit)) return nullptr;
+            n = raw(n->children()[index(n->nodemap, bit)]);
+        }
+        return nullptr;
+    }
+
+    template <typename K>
+    std::pair<iterator, bool> put(K&& k) {
+        std::size_t h = hash(k);
+        node const* at = nullptr;
+        std::size_t pos = 0;
+        if (!root) {
+            link fresh;
+            node* n = make(slot_bit(h, 0), 0, 1, 0, fresh);
+            n->add_key(std::forward<K>(k));
+            root = std::move(fresh);
+            total = 1;
+            return {iterator(root, n, 0), true};
+        }
+        link top = insert_into(raw(root), std::forward<K>(k), h, 0, at, pos);
+        if (!top) return {iterator(root, at, pos), false};
+        root = std::move(top);
+        ++total;
+        return {iterator(root, at, pos), true};
+    }
+
+    // Inserts k, hashed to h, below n. Returns the copy of n holding it, or
+    // nothing if k was there already. Either way at and pos are left at k.
+    template <typename K>
+    static link insert_into(node const* n, K&& k, std::size_t h, unsigned shift,
+                            node const*& at, std::size_t& pos) {
+        link result;
+        if (shift >= hash_bits) {
+            for (std::uint32_t i = 0; i < n->key_count; ++i) {
+                if (equal(n->keys()[i], k)) {
+                    at = n;
+                    pos = i;
+                    return nullptr;
+                }
+            }
+            node* c = make(0, 0, n->key_count + 1, 0, result);
+            for (std::uint32_t i = 0; i < n->key_count; ++i) c->add_key(n->keys()[i]);
+            pos = c->key_count;
+            c->add_key(std::forward<K>(k));
+            at = c;
+            return result;
+        }
+        std::uint32_t bit = slot_bit(h, shift);
+        if (n->datamap & bit) {
+            std::uint32_t i = index(n->datamap, bit);
+            T const& other = n->keys()[i];
+            if (equal(other, k)) {
+                at = n;
+                pos = i;
+                return nullptr;
+            }
+            // The slot's key and k move down into a new subtree.
+            link sub = pair(other, hash(other), std::forward<K>(k), h, shift + bits, at, pos);
+            node* c = make(n->datamap ^ bit, n->nodemap | bit, n->key_count - 1, n->child_count + 1, result);
+            copy_keys(n, c, 0, i);
+            copy_keys(n, c, i + 1, n->key_count);
+            std::uint32_t j = index(n->nodemap, bit);
+            copy_children(n, c, 0, j);
+            c->add_child(std::move(sub));
+            copy_children(n, c, j, n->child_count);
+            return result;
+        }
+        if (n->nodemap & bit) {
+            std::uint32_t j = index(n->nodemap, bit);
+            link sub = insert_into(raw(n->children()[j]), std::forward<K>(k), h, shift + bits, at, pos);
+            if (!sub) return sub;
+            return with_child(n, j, std::move(sub));
+        }
+        std::uint32_t i = index(n->datamap, bit);
+        node* c = make(n->datamap | bit, n->nodemap, n->key_count + 1, n->child_count, result);
+        copy_keys(n, c, 0, i);
+        c->add_key(std::forward<K>(k));
+        copy_keys(n, c, i, n->key_count);
+        copy_children(n, c, 0, n->child_count);
+        at = c;
+        pos = i;
+        return result;
+    }
+
+    // Smallest subtree holding a and b, whose hashes agree below shift.
+    template <typename K>
+    static link pair(T const& a, std::size_t ha, K&& b, std::size_t hb, unsigned shift,
+                     node const*& at, std::size_t& pos) {
+        link result;
+        if (shift >= hash_bits) {
+            node* c = make(0, 0, 2, 0, result);
+            c->add_key(a);
+            c->add_key(std::forward<K>(b));
+            at = c;
+            pos = 1;
+            return result;
+        }
+        std::uint32_t ba = slot_bit(ha, shift), bb = slot_bit(hb, shift);
+        if (ba == bb) {
+            link sub = pair(a, ha, std::forward<K>(b), hb, shift + bits, at, pos);
+            node* c = make(0, ba, 0, 1, result);
+            c->add_child(std::move(sub));
+            return result;
+        }
+        node* c = make(ba | bb, 0, 2, 0, result);
+        if (ba < bb) {
+            c->add_key(a);
+            c->add_key(std::forward<K>(b));
+        } else {
+            c->add_key(std::forward<K>(b));
+            c->add_key(a);
+        }
+        at = c;
+        pos = ba < bb ? 1 : 0;
+        return result;
+    }
+
+    // Removes k, hashed to h, from below n and reports whether it was
+    // there. Returns the copy of n without it, nothing if that is empty.
+    template <typename K>
+    static link erase_from(node const* n, K const& k, std::size_t h, unsigned shift, bool& removed) {
+        link result;
+        if (shift >= hash_bits) {
+            for (std::uint32_t i = 0; i < n->key_count; ++i) {
+                if (!equal(n->keys()[i], k)) continue;
+                removed = true;
+                node* c = make(0, 0, n->key_count - 1, 0, result);
+                copy_keys(n, c, 0, i);
+                copy_keys(n, c, i + 1, n->key_count);
+                return result;
+            }
+            return nullptr;
+        }
+        std::uint32_t bit = slot_bit(h, shift);
+        if (n->datamap & bit) {
+            std::uint32_t i = index(n->datamap, bit);
+            if (!equal(n->keys()[i], k)) return nullptr;
+            removed = true;
+            if (n->key_count == 1 && n->child_count == 0) return nullptr;
+            node* c = make(n->datamap ^ bit, n->nodemap, n->key_count - 1, n->child_count, result);
+            copy_keys(n, c, 0, i);
+            copy_keys(n, c, i + 1, n->key_count);
+            copy_children(n, c, 0, n->child_count);
+            return result;
+        }
+        if (!(n->nodemap & bit)) return nullptr;
+        std::uint32_t j = index(n->nodemap, bit);
+        link sub = erase_from(raw(n->children()[j]), k, h, shift + bits, removed);
+        if (!removed) return nullptr;
+        if (sub->key_count != 1 || sub->child_count != 0) return with_child(n, j, std::move(sub));
+
+        // A single key left below: it takes the subtree's slot here.
+        std::uint32_t i = index(n->datamap, bit);
+        node* c = make(n->datamap | bit, n->nodemap ^ bit, n->key_count + 1, n->child_count - 1, result);
+        copy_keys(n, c, 0, i);
+        c->add_key(sub->keys()[0]);
+        copy_keys(n, c, i, n->key_count);
+        copy_children(n, c, 0, j);
+        copy_children(n, c, j + 1, n->child_count);
+        return result;
+    }
+
+    // Copy of n with child j replaced by sub.
+    static link with_child(node const* n, std::uint32_t j, link sub) {
+        link result;
+        node* c = make(n->datamap, n->nodemap, n->key_count, n->child_count, result);
+        copy_keys(n, c, 0, n->key_count);
+        copy_children(n, c, 0, j);
+        c->add_child(std::move(sub));
+        copy_children(n, c, j + 1, n->child_count);
+        return result;
+    }
+
+    // Appends the keys [from, to) of n to c.
+    static void copy_keys(node const* n, node* c, std::uint32_t from, std::uint32_t to) {
+        for (std::uint32_t i = from; i < to; ++i) c->add_key(n->keys()[i]);
+    }
+
+    static void copy_children(node const* n, node* c, std::uint32_t from, std::uint32_t to) {
+        for (std::uint32_t i = from; i < to; ++i) c->add_child(link(n->children()[i]));
+    }
+};
+
+template <typename T, template<typename> class scoped_ptr, typename allocator, typename Hash,
+          typename KeyEqual>
+struct persistent_hash_set<T, scoped_ptr, allocator, Hash, KeyEqual>::iterator
+{
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T const*;
+    using reference = T const&;
+
+    value_type const& operator*() const {
+        return path.top().first->keys()[pos];
+    }
+
+    value_type const* operator->() const {
+        return &path.top().first->keys()[pos];
+    }
+
+    iterator& operator++() {
+        attach();
+        if (++pos < path.top().first->key_count) return *this;
+        advance();
+        return *this;
+    }
+
+    iterator operator++(int) {
+        iterator i = *this;
+        ++(*this);
+        return i;
+    }
+
+    friend bool operator ==(iterator const& a, iterator const& b) noexcept {
+        return a.owner == b.owner && a.current() == b.current() && a.pos == b.pos;
+    }
+
+    friend bool operator !=(iterator const& a, iterator const& b) noexcept {
+        return !(a == b);
+    }
+
+private:
+
+    friend struct persistent_hash_set;
+
+    explicit iterator(link const& owner) noexcept
+        : owner(owner) {}
+
+    // Lazy position: find and insert know only the trie node holding the
+    // key, a bitmap node or a collision node at the bottom, and the key's
+    // slot in it. That node alone goes on the path; attach() rebuilds the
+    // levels above from the key's hash the first time the iterator moves.
+    iterator(link const& owner, node const* at, std::size_t pos)
+        : owner(owner), pos(pos), detached(true) {
+        path.push({at, 0});
+    }
+
+    node const* current() const noexcept {
+        return path.empty() ? nullptr : path.top().first;
+    }
+
+    // Follows the hash of the current key from the root, noting for every
+    // node on the way the first subtree still to visit.
+    void attach() {
+        if (!detached) return;
+        detached = false;
+        node const* at = path.top().first;
+        path.clear();
+        std::size_t h = hash(at->keys()[pos]);
+        node const* cur = raw(owner);
+        for (unsigned shift = 0; cur != at; shift += bits) {
+            std::uint32_t j = index(cur->nodemap, slot_bit(h, shift));
+            path.push({cur, j + 1});
+            cur = raw(cur->children()[j]);
+        }
+        path.push({at, 0});
+    }
+
+    // Moves to the first key of the next node in visiting order, or to
+    // end() when there is none.
+    void advance() {
+        pos = 0;
+        for (;;) {
+            auto& top = path.top();
+            if (top.second < top.first->child_count) {
+                node const* c = raw(top.first->children()[top.second++]);
+                path.push({c, 0});
+                if (c->key_count) return;
+            } else {
+                path.pop();
+                if (path.empty()) return;
+            }
+        }
+    }
+
+    // The nodes from the root down to the current one, each with the index
+    // of its next child to visit: a node's own keys come before its
+    // children. pos is the current key among the keys of the deepest node.
+    // The pointers are plain, as in persistent_set's iterator.
+    link owner;
+    small_stack<std::pair<node const*, std::uint32_t>, max_depth> path;
+    std::size_t pos {0};
+    bool detached {false};
+};
+
+#endif // PERSISTENT_HASH_SET_H
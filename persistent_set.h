@@ -1,28 +1,100 @@
 #ifndef PERSISTENT_SET_H
 #define PERSISTENT_SET_H
 
-#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <type_traits>
+#include <utility>
 #include <vector>
-#include <cassert>
+#include "augmentation.h"
+#include "pointer_traits.h"
 #include "smart_shared_pointer.h"
+#include "balance_policy.h"
+#include "key_storage.h"
+#include "node_allocator.h"
+#include "small_stack.h"
 
-template <typename T, template<typename> class scoped_ptr = smart_shared_pointer>
+// Tag for ranges already sorted by the comparator and free of duplicates;
+// the range is then trusted without being checked.
+struct sorted_unique_t {};
+constexpr sorted_unique_t sorted_unique {};
+
+// What apply_batch does with the key of an update.
+enum class batch_op { insert, erase };
+
+// How set algebra shares its work between threads. The recursion forks at
+// most forks levels deep, into up to 2^forks threads, and only where the
+// two halves hold at least cutoff keys between them. none(), the default,
+// keeps the work on the calling thread; per_core() forks enough levels for
+// one thread per core, and with a single core does not fork at all.
+// Policies that cannot share nodes between threads never fork.
+struct parallelism
+{
+    static constexpr std::size_t default_cutoff = 1 << 14;
+
+    int forks;
+    std::size_t cutoff;
+
+    static parallelism per_core() {
+        unsigned cores = std::thread::hardware_concurrency();
+        int depth = 0;
+        while ((1u << depth) < cores) ++depth;
+        return {depth, default_cutoff};
+    }
+
+    static parallelism none() {
+        return {0, default_cutoff};
+    }
+};
+
+template <typename T, template<typename> class scoped_ptr = smart_shared_pointer,
+          typename balancer = weight_balanced, typename allocator = default_node_allocator,
+          typename Compare = std::less<T>, typename augmentation = no_augmentation>
 struct persistent_set
 {
     using value_type = T;
-    struct iterator;
+    using key_compare = Compare;
+    using aggregate_type = typename augmentation::type;
+
+    static_assert(noexcept(augmentation::identity())
+                  && noexcept(augmentation::of(std::declval<T const&>()))
+                  && noexcept(augmentation::combine(std::declval<aggregate_type const&>(),
+                                                    std::declval<aggregate_type const&>()))
+                  && std::is_nothrow_move_constructible<aggregate_type>::value
+                  && std::is_nothrow_move_assignable<aggregate_type>::value,
+                  "persistent_set: augmentation::identity, of and combine must not throw");
+
+    template <bool borrowed> struct basic_iterator;
+    using iterator = basic_iterator<false>;
+    using borrowed_iterator = basic_iterator<true>;
+    struct range_view;
+    struct borrowed_view;
+    struct transient_set;
 
     persistent_set() {}
 
-    persistent_set(persistent_set const& other) noexcept {
-        root = other.root;
+    template <typename It, typename = typename std::iterator_traits<It>::iterator_category>
+    persistent_set(It first, It last) {
+        assign(first, last);
+    }
+
+    template <typename It, typename = typename std::iterator_traits<It>::iterator_category>
+    persistent_set(sorted_unique_t, It first, It last) {
+        assign(sorted_unique, first, last);
     }
 
-    persistent_set(persistent_set&& other) noexcept {
+    persistent_set(persistent_set const& other) noexcept {
         root = other.root;
-        other.root = nullptr;
     }
 
+    persistent_set(persistent_set&& other) noexcept : root(std::move(other.root)) {}
+
     ~persistent_set() noexcept {}
 
     persistent_set& operator=(persistent_set const& other) noexcept {
@@ -36,253 +108,1357 @@ struct persistent_set
         return *this;
     }
 
+    // Replaces the contents with the keys of [first, last). A range that is
+    // already strictly increasing is built directly; anything else is sorted
+    // first, keeping the first of equivalent keys as insert would. Either
+    // way the tree is built bottom-up, perfectly balanced, with one node
+    // allocation per key.
+    template <typename It, typename = typename std::iterator_traits<It>::iterator_category>
+    void assign(It first, It last) {
+        assign_checked(first, last, typename std::iterator_traits<It>::iterator_category());
+    }
+
+    template <typename It, typename = typename std::iterator_traits<It>::iterator_category>
+    void assign(sorted_unique_t, It first, It last) {
+        assign_sorted(first, last, typename std::iterator_traits<It>::iterator_category());
+    }
+
     void swap(persistent_set& other) {
         swap(root, other.root);
     }
 
-    iterator find(value_type value) const {
-        return iterator(root, get(root, value));
+    iterator find(value_type const& value) const {
+        return seek<iterator>(value);
+    }
+
+    // Lookups by any key the comparator can compare with value_type, when
+    // it declares is_transparent (std::less<>, for instance).
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(K const& key) const {
+        return seek<iterator>(key);
+    }
+
+    // First key not less than value.
+    iterator lower_bound(value_type const& value) const {
+        return bound<false>(value);
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator lower_bound(K const& key) const {
+        return bound<false>(key);
+    }
+
+    // First key greater than value.
+    iterator upper_bound(value_type const& value) const {
+        return bound<true>(value);
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator upper_bound(K const& key) const {
+        return bound<true>(key);
+    }
+
+    std::pair<iterator, iterator> equal_range(value_type const& value) const {
+        return {bound<false>(value), bound<true>(value)};
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    std::pair<iterator, iterator> equal_range(K const& key) const {
+        return {bound<false>(key), bound<true>(key)};
+    }
+
+    // The keys in [lo, hi), for range-for. Both ends are found by one
+    // descent each; stepping between them follows the iterator's own path
+    // and never goes back to the root.
+    range_view range(value_type const& lo, value_type const& hi) const {
+        return range_of(lo, hi);
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    range_view range(K const& lo, K const& hi) const {
+        return range_of(lo, hi);
+    }
+
+    bool contains(value_type const& value) const {
+        return lookup(value) != nullptr;
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    bool contains(K const& key) const {
+        return lookup(key) != nullptr;
+    }
+
+    std::size_t count(value_type const& value) const {
+        return contains(value) ? 1 : 0;
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    std::size_t count(K const& key) const {
+        return contains(key) ? 1 : 0;
+    }
+
+    std::size_t size() const noexcept {
+        return editor::size(root);
+    }
+
+    bool empty() const noexcept {
+        return !root;
+    }
+
+    // Number of keys less than value.
+    std::size_t rank(value_type const& value) const {
+        return rank_of(value);
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    std::size_t rank(K const& key) const {
+        return rank_of(key);
+    }
+
+    // The key with k keys before it, or end() if k >= size().
+    iterator select(std::size_t k) const {
+        iterator it(root);
+        if (k >= size()) return it;
+        node const* cur = raw(root);
+        for (;;) {
+            it.path.push(cur);
+            std::size_t left = editor::size(cur->left);
+            if (k == left) return it;
+            if (k < left) {
+                cur = raw(cur->left);
+            } else {
+                k -= left + 1;
+                cur = raw(cur->right);
+            }
+        }
+    }
+
+    // Number of keys in [lo, hi).
+    std::size_t count_range(value_type const& lo, value_type const& hi) const {
+        return count_between(lo, hi);
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    std::size_t count_range(K const& lo, K const& hi) const {
+        return count_between(lo, hi);
+    }
+
+    // Aggregate of all keys, in O(1).
+    aggregate_type aggregate() const {
+        return aggregate_of(root);
+    }
+
+    // Aggregate of the keys in [lo, hi), in O(log n).
+    aggregate_type aggregate(value_type const& lo, value_type const& hi) const {
+        return aggregate_between(lo, hi);
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    aggregate_type aggregate(K const& lo, K const& hi) const {
+        return aggregate_between(lo, hi);
     }
 
     std::pair<iterator, bool> insert(value_type const& value) {
-        if (get(root, value)) return {iterator(root, get(root, value)), false};
-        root = put(root, value);
-        return {iterator(root, get(root, value)), true};
+        editor ed;
+        root = put(ed, root, value);
+        return {iterator(root, ed.tracked), ed.changed};
     }
 
     std::pair<iterator, bool> insert(value_type&& value) {
-        if (get(root, value)) return {iterator(root, get(root, value)), false};
-        root = put(root, value);
-        return {iterator(root, get(root, value)), true};
+        editor ed;
+        root = put(ed, root, std::move(value));
+        return {iterator(root, ed.tracked), ed.changed};
     }
 
     void erase(iterator it) {
-        root = del(root, *it);
+        editor ed;
+        root = del(ed, root, *it);
+    }
+
+    std::size_t erase(value_type const& value) {
+        editor ed;
+        root = del(ed, root, value);
+        return ed.changed ? 1 : 0;
+    }
+
+    // Applies a batch of (key, batch_op) pairs, sorted by key with no key
+    // twice, in one pass over the tree: the batch is split at every node
+    // it reaches, each node on the way is copied at most once, untouched
+    // subtrees stay shared and new keys are built into balanced subtrees.
+    // Returns the number of keys added or removed.
+    template <typename It>
+    std::size_t apply_batch(It first, It last) {
+        editor ed;
+        std::size_t applied = 0;
+        try {
+            root = patch(ed, root, true, 0, first, last, applied);
+        } catch (...) {
+            ed.rollback();
+            throw;
+        }
+        return applied;
+    }
+
+    // A mutable builder starting from this version; see transient_set.
+    transient_set transient() const {
+        return transient_set(*this);
+    }
+
+    // Calls f(key) for every key in order. Unlike iterators, which hold a
+    // reference to their version, this walks borrowed node pointers and
+    // writes no memory shared with other readers. The set must stay
+    // untouched until it returns. borrow() gives iterators that work the
+    // same way.
+    template <typename F>
+    void for_each(F f) const {
+        walk<value_type>(nullptr, nullptr, f);
+    }
+
+    // The same for the keys in [lo, hi).
+    template <typename F>
+    void for_each(value_type const& lo, value_type const& hi, F f) const {
+        walk(&lo, &hi, f);
     }
 
     iterator begin() const {
-        return iterator(root, getMin(root));
+        return leftmost<iterator>();
     }
 
     iterator end() const {
-        return iterator(root, nullptr);
+        return iterator(root);
+    }
+
+    // Lookups whose iterators point at this set instead of holding a
+    // reference to its version; see borrowed_view.
+    borrowed_view borrow() const noexcept {
+        return borrowed_view(*this);
+    }
+
+    key_compare key_comp() const {
+        return Compare();
+    }
+
+    // Set algebra by split and join (Blelloch, Ferizovic and Sun). Each
+    // takes O(m log(n/m + 1)) for sizes m <= n, returns subtrees the two
+    // operands share without looking into them, and runs on the calling
+    // thread unless par asks for more and the pointer policy is thread safe.
+    friend persistent_set set_union(persistent_set const& a, persistent_set const& b,
+                                    parallelism par = parallelism::none()) {
+        editor ed;
+        persistent_set result;
+        result.root = unite(ed, a.root, b.root, usable(par));
+        return result;
+    }
+
+    friend persistent_set set_intersection(persistent_set const& a, persistent_set const& b,
+                                           parallelism par = parallelism::none()) {
+        editor ed;
+        persistent_set result;
+        result.root = intersect(ed, a.root, b.root, usable(par));
+        return result;
+    }
+
+    // Keys of a that are not in b.
+    friend persistent_set set_difference(persistent_set const& a, persistent_set const& b,
+                                         parallelism par = parallelism::none()) {
+        editor ed;
+        persistent_set result;
+        result.root = subtract(ed, a.root, b.root, usable(par));
+        return result;
+    }
+
+    // Reports how a differs from b, in increasing key order: emit(key,
+    // batch_op::erase) for keys only in a, emit(key, batch_op::insert) for
+    // keys only in b. Collected into a vector the updates form a batch that
+    // turns a into b via apply_batch. Subtrees both versions share are
+    // skipped whole, so versions derived from each other are compared in
+    // time proportional to the change. Neither set may be edited meanwhile.
+    template <typename F>
+    friend void diff(persistent_set const& a, persistent_set const& b, F emit) {
+        diff_walk(raw(a.root), raw(b.root), emit);
     }
 
 private:
 
-    struct node {
-        T key {};
+    // Root-to-node paths up to this depth are kept on the stack. That covers
+    // any weight-balanced tree that fits in memory in practice; deeper paths
+    // (unbalanced trees) spill to the heap.
+    static constexpr std::size_t inline_depth = 48;
+
+    // In-place rebuilds one edit can record for undo on the stack: one per
+    // owned node on the path, plus a few for rotations. Longer logs (deep
+    // unbalanced trees) spill to the heap.
+    static constexpr std::size_t undo_depth = inline_depth;
+
+    struct node : pointer_traits<scoped_ptr>::node_base, aggregate_slot<augmentation> {
+        key_storage<T, scoped_ptr, allocator> stored;
         scoped_ptr<node> left {nullptr};
         scoped_ptr<node> right {nullptr};
+        std::size_t size {1};
+        // Token of the last edit that owned the node, 0 for none.
+        std::uint64_t edit {0};
 
         explicit node(T const& val, scoped_ptr<node> left = nullptr, scoped_ptr<node> right = nullptr)
-            : key(val), left(left), right(right) {}
+            : stored(val), left(std::move(left)), right(std::move(right)) {
+            refresh();
+        }
 
         explicit node(T&& val, scoped_ptr<node> left = nullptr, scoped_ptr<node> right = nullptr)
-            : key(std::move(val)), left(left), right(right) {}
+            : stored(std::move(val)), left(std::move(left)), right(std::move(right)) {
+            refresh();
+        }
+
+        // A copy of src over new children, holding the same key.
+        node(node const& src, scoped_ptr<node> left, scoped_ptr<node> right)
+            : stored(src.stored), left(std::move(left)), right(std::move(right)) {
+            refresh();
+        }
+
+        ~node() noexcept {
+            tear_down(std::move(left));
+            tear_down(std::move(right));
+        }
+
+        T const& key() const noexcept {
+            return stored.get();
+        }
+
+        // Recomputes what the node keeps about its subtree from its children.
+        void refresh() {
+            size = 1 + editor::size(left) + editor::size(right);
+            this->set_aggregate(augmentation::combine(
+                augmentation::combine(aggregate_of(left), augmentation::of(key())), aggregate_of(right)));
+        }
+
+        static void* operator new(std::size_t size) {
+            return allocator::allocate(size);
+        }
+
+        static void operator delete(void* p, std::size_t size) noexcept {
+            allocator::deallocate(p, size);
+        }
+
+    private:
+
+        // Releases the subtree t without recursing, so that dropping a
+        // degenerate tree takes no stack. While t is the only link to its
+        // node, the left child is rotated up over it; once t has no left
+        // child it is freed childless and its right child is next. Shared
+        // nodes are only released.
+        static void tear_down(scoped_ptr<node> t) noexcept {
+            while (t && pointer_traits<scoped_ptr>::unique(t)) {
+                if (t->left) {
+                    scoped_ptr<node> l = std::move(t->left);
+                    if (!pointer_traits<scoped_ptr>::unique(l)) continue;
+                    t->left = std::move(l->right);
+                    l->right = std::move(t);
+                    t = std::move(l);
+                } else {
+                    scoped_ptr<node> r = std::move(t->right);
+                    t = std::move(r);
+                }
+            }
+        }
+    };
+
+    // Everything the balance policy may do to the tree goes through here.
+    // An edit also reports whether it changed anything and follows the node
+    // holding the key it was after, so that node survives rotations.
+    //
+    // Nodes marked with the editor's token are owned by the edit: nobody
+    // outside it can reach them, so they are changed in place instead of
+    // copied. Marks come from claim(), from left/right (a sole child of an
+    // owned node is owned too) and from the nodes the edit creates. A
+    // transient keeps one token for all its edits; a plain edit draws its
+    // own.
+    struct editor {
+        using link = scoped_ptr<node>;
+
+        static constexpr std::size_t inline_depth = persistent_set::inline_depth;
+
+        bool changed {false};
+        node const* tracked {nullptr};
+        std::uint64_t token {next_token()};
+
+        editor() = default;
+
+        explicit editor(std::uint64_t token) : token(token) {}
+
+        editor(editor const&) = delete;
+        editor& operator = (editor const&) = delete;
+
+        static std::size_t size(link const& p) noexcept {
+            return p ? p->size : 0;
+        }
+
+        link left(link const& p) {
+            adopt(p, p->left);
+            return p->left;
+        }
+
+        link right(link const& p) {
+            adopt(p, p->right);
+            return p->right;
+        }
+
+        link rebuild(link src, link l, link r) {
+            if (owns(src)) {
+                undo.push(saved_node{src, nullptr, nullptr, false, src->size, src->aggregate()});
+                if (raw(l) != raw(src->left) || raw(r) != raw(src->right)) {
+                    saved_node& s = undo.top();
+                    s.left = std::move(src->left);
+                    s.right = std::move(src->right);
+                    s.relinked = true;
+                    src->left = std::move(l);
+                    src->right = std::move(r);
+                }
+                src->refresh();
+                return src;
+            }
+            link result(new node(*src, std::move(l), std::move(r)));
+            result->edit = token;
+            if (raw(src) == tracked) tracked = raw(result);
+            return result;
+        }
+
+        template <typename K>
+        link leaf(K&& k) const {
+            link result(new node(std::forward<K>(k)));
+            result->edit = token;
+            return result;
+        }
+
+        bool owns(link const& p) const noexcept {
+            return p->edit == token;
+        }
+
+        // Takes p for this edit if nobody else can reach it. Only valid when
+        // the link holding p is itself the root or inside an owned node.
+        bool claim(link const& p) {
+            if (owns(p)) return true;
+            if (!pointer_traits<scoped_ptr>::unique(p)) return false;
+            p->edit = token;
+            return true;
+        }
+
+        // Puts every node the edit changed in place back as it was, so that
+        // a failed edit leaves the tree exactly as it found it. Each in-place
+        // rebuild saved what it overwrote before touching the node, so the
+        // records are replayed latest first and nothing is recomputed or
+        // allocated here.
+        void rollback() noexcept {
+            while (!undo.empty()) {
+                saved_node& s = undo.top();
+                if (s.relinked) {
+                    s.target->left = std::move(s.left);
+                    s.target->right = std::move(s.right);
+                }
+                s.target->size = s.size;
+                s.target->set_aggregate(std::move(s.aggregate));
+                undo.pop();
+            }
+        }
+
+    private:
+
+        // A node as it was before an in-place rebuild: its children, if the
+        // rebuild changed them, and what it kept about its subtree. Holding
+        // the old children keeps every node of the old tree alive until the
+        // edit is over.
+        struct saved_node {
+            link target;
+            link left;
+            link right;
+            bool relinked;
+            std::size_t size;
+            aggregate_type aggregate;
+        };
+
+        small_stack<saved_node, undo_depth> undo;
+
+        void adopt(link const& parent, link const& child) {
+            if (child && owns(parent)) claim(child);
+        }
     };
 
     mutable scoped_ptr<node> root {nullptr};
 
-    static scoped_ptr<node> get(scoped_ptr<node> cur, T k) {
-        if (cur == nullptr) return nullptr;
-        if (k < cur->key)
-            return get(cur->left, k);
-        else if (k > cur->key)
-            return get(cur->right, k);
-        else return cur;
+    // Edit tokens are never reused, so a node marked by a finished edit or
+    // by a frozen transient never matches again. Threads take them from the
+    // shared counter in blocks.
+    static std::uint64_t next_token() noexcept {
+        static std::atomic<std::uint64_t> last {0};
+        static thread_local std::uint64_t next = 0, end = 0;
+        if (next == end) {
+            next = last.fetch_add(token_block, std::memory_order_relaxed) + 1;
+            end = next + token_block;
+        }
+        return next++;
+    }
+
+    static constexpr std::uint64_t token_block = 1024;
+
+    static node const* raw(scoped_ptr<node> const& p) noexcept {
+        return p ? &*p : nullptr;
+    }
+
+    static node const* raw(node const* p) noexcept {
+        return p;
+    }
+
+    // The comparator is stateless: a fresh one is made for every comparison.
+    template <typename A, typename B>
+    static bool less(A const& a, B const& b) {
+        return Compare()(a, b);
+    }
+
+    template <typename K>
+    node const* lookup(K const& k) const {
+        node const* cur = raw(root);
+        while (cur) {
+            if (less(k, cur->key()))
+                cur = raw(cur->left);
+            else if (less(cur->key(), k))
+                cur = raw(cur->right);
+            else return cur;
+        }
+        return nullptr;
+    }
+
+    template <typename It>
+    void assign_checked(It first, It last, std::forward_iterator_tag tag) {
+        if (first != last) {
+            It prev = first, cur = first;
+            while (++cur != last && less(*prev, *cur)) prev = cur;
+            if (cur == last) {
+                assign_sorted(first, last, tag);
+                return;
+            }
+        }
+        assign_checked(first, last, std::input_iterator_tag());
+    }
+
+    template <typename It>
+    void assign_checked(It first, It last, std::input_iterator_tag) {
+        std::vector<T> keys(first, last);
+        std::stable_sort(keys.begin(), keys.end(), Compare());
+        auto tail = std::unique(keys.begin(), keys.end(), [](T const& a, T const& b) {
+            return !less(a, b);
+        });
+        keys.erase(tail, keys.end());
+        assign_sorted(std::make_move_iterator(keys.begin()), std::make_move_iterator(keys.end()),
+                      std::forward_iterator_tag());
+    }
+
+    template <typename It>
+    void assign_sorted(It first, It last, std::forward_iterator_tag) {
+        root = build_sorted(first, static_cast<std::size_t>(std::distance(first, last)));
+    }
+
+    template <typename It>
+    static scoped_ptr<node> build_sorted(It first, std::size_t n) {
+        return build(first, n, [](It& it) -> decltype(*it) { return *it; });
+    }
+
+    template <typename It>
+    void assign_sorted(It first, It last, std::input_iterator_tag) {
+        std::vector<T> keys(first, last);
+        assign_sorted(std::make_move_iterator(keys.begin()), std::make_move_iterator(keys.end()),
+                      std::forward_iterator_tag());
+    }
+
+    // Takes the next n keys from it, in order: the left half first, then the
+    // middle key, then the right half. Sizes of siblings differ by at most
+    // one, which every balance policy accepts. pick(it) moves it forward to
+    // the next key to take, if needed, and returns that key.
+    template <typename It, typename Pick>
+    static scoped_ptr<node> build(It& it, std::size_t n, Pick pick) {
+        if (n == 0) return nullptr;
+        scoped_ptr<node> l = build(it, n / 2, pick);
+        node* mid = new node(pick(it));
+        scoped_ptr<node> top(mid);
+        ++it;
+        mid->left = std::move(l);
+        mid->right = build(it, n - n / 2 - 1, pick);
+        mid->refresh();
+        return top;
     }
 
-    static scoped_ptr<node> put(scoped_ptr<node> cur, T k) {
-        if (cur == nullptr) {
-            return scoped_ptr<node>(new node(k));
+    // The part of a batch below t: [first, lo) goes to the left subtree,
+    // [hi, last) to the right one, and an update of t's own key, if any,
+    // sits in between. owned tells whether the link holding t is owned by
+    // the edit, so that t may be claimed. Below inline_depth, which only a
+    // degenerate tree reaches, the rest of the batch is applied key by key
+    // with the iterative put and del instead of recursing further.
+    template <typename It>
+    static scoped_ptr<node> patch(editor& ed, scoped_ptr<node> const& t, bool owned, std::size_t depth,
+                                  It first, It last, std::size_t& applied) {
+        if (first == last) return t;
+        if (!t) {
+            std::size_t n = 0;
+            for (It i = first; i != last; ++i) {
+                if (i->second == batch_op::insert) ++n;
+            }
+            applied += n;
+            return build(first, n, [](It& it) -> value_type const& {
+                while (it->second != batch_op::insert) ++it;
+                return it->first;
+            });
         }
 
-        scoped_ptr<node> new_cur = scoped_ptr<node>(new node(cur->key, cur->left, cur->right));
+        if (depth > inline_depth) return patch_each(ed, t, owned, first, last, applied);
+
+        using update = typename std::iterator_traits<It>::value_type;
+        node const* n = raw(t);
+        It lo = std::lower_bound(first, last, n->key(), [](update const& u, T const& k) {
+            return less(u.first, k);
+        });
+        It hi = lo;
+        bool hit = lo != last && !less(n->key(), lo->first);
+        if (hit) ++hi;
 
-        if (k < cur->key) {
-            new_cur->left = put(cur->left, k);
-        } else if (k > cur->key) {
-            new_cur->right = put(cur->right, k);
+        // Owned children may be changed in place, so whether anything below
+        // changed is told by the count rather than by the links.
+        owned = owned && ed.claim(t);
+        std::size_t before = applied;
+        scoped_ptr<node> l = patch(ed, n->left, owned, depth + 1, first, lo, applied);
+        scoped_ptr<node> r = patch(ed, n->right, owned, depth + 1, hi, last, applied);
+        if (hit && lo->second == batch_op::erase) {
+            ++applied;
+            return balancer::merge(ed, std::move(l), std::move(r));
         }
+        if (applied == before) return t;
+        return balancer::join(ed, t, std::move(l), std::move(r));
+    }
 
-        return new_cur;
+    // t is claimed up front while its link is known to be owned: the copy
+    // of the link taken here would keep put and del from claiming it.
+    template <typename It>
+    static scoped_ptr<node> patch_each(editor& ed, scoped_ptr<node> const& t, bool owned,
+                                       It first, It last, std::size_t& applied) {
+        if (owned) ed.claim(t);
+        scoped_ptr<node> cur = t;
+        for (; first != last; ++first) {
+            ed.changed = false;
+            if (first->second == batch_op::insert)
+                cur = put(ed, cur, first->first);
+            else
+                cur = del(ed, cur, first->first);
+            if (ed.changed) ++applied;
+        }
+        return cur;
+    }
+
+    // Splits t around k into the keys below k (l) and above it (r). Returns
+    // whether k itself was in t. The split follows one path down; the nodes
+    // on it are kept with the child not taken and joined back on the way up.
+    static bool split(editor& ed, scoped_ptr<node> t, T const& k,
+                      scoped_ptr<node>& l, scoped_ptr<node>& r) {
+        struct step {
+            scoped_ptr<node> top;
+            scoped_ptr<node> other;
+            bool went_left;
+        };
+        small_stack<step, inline_depth> path;
+        bool found = false;
+        l = nullptr;
+        r = nullptr;
+        while (t) {
+            scoped_ptr<node> tl = ed.left(t);
+            scoped_ptr<node> tr = ed.right(t);
+            if (less(k, t->key())) {
+                path.push(step{std::move(t), std::move(tr), true});
+                t = std::move(tl);
+            } else if (less(t->key(), k)) {
+                path.push(step{std::move(t), std::move(tl), false});
+                t = std::move(tr);
+            } else {
+                l = std::move(tl);
+                r = std::move(tr);
+                found = true;
+                break;
+            }
+        }
+        while (!path.empty()) {
+            step& s = path.top();
+            if (s.went_left)
+                r = balancer::join(ed, std::move(s.top), std::move(r), std::move(s.other));
+            else
+                l = balancer::join(ed, std::move(s.top), std::move(s.other), std::move(l));
+            path.pop();
+        }
+        return found;
+    }
+
+    static parallelism usable(parallelism par) {
+        if (!pointer_traits<scoped_ptr>::thread_safe) par.forks = 0;
+        return par;
+    }
+
+    // Runs both halves of a set operation, the right one on another thread
+    // when the halves are big enough and forks remain. The halves work on
+    // disjoint new nodes, so each gets its own editor on the same token.
+    template <typename L, typename R>
+    static void fork_join(editor& ed, parallelism par, std::size_t work, L left, R right) {
+        if (par.forks > 0 && work >= par.cutoff) {
+            --par.forks;
+            editor other(ed.token);
+            auto done = std::async(std::launch::async, [&] { right(other, par); });
+            left(ed, par);
+            done.get();
+            return;
+        }
+        left(ed, par);
+        right(ed, par);
+    }
+
+    // The set operations recurse along one operand. Past inline_depth,
+    // which only a degenerate tree reaches, the rest is done on the sorted
+    // keys of both sides and rebuilt balanced in O(n).
+    static scoped_ptr<node> unite(editor& ed, scoped_ptr<node> a, scoped_ptr<node> b, parallelism par,
+                                  std::size_t depth = 0) {
+        if (!a) return b;
+        if (!b || raw(a) == raw(b)) return a;
+        if (depth > inline_depth) {
+            std::vector<T> ka = keys_of(raw(a)), kb = keys_of(raw(b)), out;
+            std::set_union(ka.begin(), ka.end(), kb.begin(), kb.end(), std::back_inserter(out), Compare());
+            return build_sorted(std::make_move_iterator(out.begin()), out.size());
+        }
+        scoped_ptr<node> bl, br;
+        split(ed, std::move(b), a->key(), bl, br);
+        scoped_ptr<node> al = ed.left(a);
+        scoped_ptr<node> ar = ed.right(a);
+        scoped_ptr<node> l, r;
+        fork_join(ed, par, editor::size(a) + editor::size(bl) + editor::size(br),
+                  [&](editor& e, parallelism p) { l = unite(e, std::move(al), std::move(bl), p, depth + 1); },
+                  [&](editor& e, parallelism p) { r = unite(e, std::move(ar), std::move(br), p, depth + 1); });
+        return balancer::join(ed, std::move(a), std::move(l), std::move(r));
+    }
+
+    static scoped_ptr<node> intersect(editor& ed, scoped_ptr<node> a, scoped_ptr<node> b, parallelism par,
+                                      std::size_t depth = 0) {
+        if (!a || !b) return nullptr;
+        if (raw(a) == raw(b)) return a;
+        if (depth > inline_depth) {
+            std::vector<T> ka = keys_of(raw(a)), kb = keys_of(raw(b)), out;
+            std::set_intersection(ka.begin(), ka.end(), kb.begin(), kb.end(), std::back_inserter(out),
+                                  Compare());
+            return build_sorted(std::make_move_iterator(out.begin()), out.size());
+        }
+        scoped_ptr<node> bl, br;
+        bool found = split(ed, std::move(b), a->key(), bl, br);
+        scoped_ptr<node> al = ed.left(a);
+        scoped_ptr<node> ar = ed.right(a);
+        scoped_ptr<node> l, r;
+        fork_join(ed, par, editor::size(a) + editor::size(bl) + editor::size(br),
+                  [&](editor& e, parallelism p) { l = intersect(e, std::move(al), std::move(bl), p, depth + 1); },
+                  [&](editor& e, parallelism p) { r = intersect(e, std::move(ar), std::move(br), p, depth + 1); });
+        if (found) return balancer::join(ed, std::move(a), std::move(l), std::move(r));
+        return balancer::merge(ed, std::move(l), std::move(r));
+    }
+
+    static scoped_ptr<node> subtract(editor& ed, scoped_ptr<node> a, scoped_ptr<node> b, parallelism par,
+                                     std::size_t depth = 0) {
+        if (!a || raw(a) == raw(b)) return nullptr;
+        if (!b) return a;
+        if (depth > inline_depth) {
+            std::vector<T> ka = keys_of(raw(a)), kb = keys_of(raw(b)), out;
+            std::set_difference(ka.begin(), ka.end(), kb.begin(), kb.end(), std::back_inserter(out),
+                                Compare());
+            return build_sorted(std::make_move_iterator(out.begin()), out.size());
+        }
+        scoped_ptr<node> al, ar;
+        split(ed, std::move(a), b->key(), al, ar);
+        scoped_ptr<node> bl = ed.left(b);
+        scoped_ptr<node> br = ed.right(b);
+        scoped_ptr<node> l, r;
+        fork_join(ed, par, editor::size(al) + editor::size(ar) + editor::size(b),
+                  [&](editor& e, parallelism p) { l = subtract(e, std::move(al), std::move(bl), p, depth + 1); },
+                  [&](editor& e, parallelism p) { r = subtract(e, std::move(ar), std::move(br), p, depth + 1); });
+        return balancer::merge(ed, std::move(l), std::move(r));
     }
 
-    static scoped_ptr<node> put(scoped_ptr<node> cur, T&& k) {
-        if (cur == nullptr) {
-            return scoped_ptr<node>(new node(k));
+    // The keys of t in order, walked with an explicit stack.
+    static std::vector<T> keys_of(node const* t) {
+        std::vector<T> keys;
+        keys.reserve(t ? t->size : 0);
+        small_stack<node const*, inline_depth> pending;
+        for (; t; t = raw(t->left)) pending.push(t);
+        while (!pending.empty()) {
+            node const* n = pending.top();
+            pending.pop();
+            keys.push_back(n->key());
+            for (node const* cur = raw(n->right); cur; cur = raw(cur->left)) pending.push(cur);
         }
+        return keys;
+    }
+
+    // What is left of one side of a diff, in order from the top: subtrees
+    // not looked into yet, and nodes whose left subtree is done and whose
+    // own key is next.
+    using diff_stack = small_stack<std::pair<node const*, bool>, 2 * inline_depth>;
 
-        scoped_ptr<node> new_cur = scoped_ptr<node>(cur);
+    static void expand(diff_stack& st) {
+        node const* n = st.top().first;
+        st.pop();
+        if (n->right) st.push({raw(n->right), false});
+        st.push({n, true});
+        if (n->left) st.push({raw(n->left), false});
+    }
 
-        if (k < cur->key) {
-            new_cur->left = put(cur->left, k);
-        } else if (k > cur->key) {
-            new_cur->right = put(cur->right, k);
+    // Both sides are walked in order together. When both next hold the
+    // very same subtree it is dropped from both; otherwise the bigger
+    // unexpanded subtree is opened up first, which keeps shared subtrees
+    // lined up on the two stacks.
+    template <typename F>
+    static void diff_walk(node const* a, node const* b, F& emit) {
+        diff_stack sa, sb;
+        if (a) sa.push({a, false});
+        if (b) sb.push({b, false});
+        while (!sa.empty() || !sb.empty()) {
+            if (sa.empty() || sb.empty()) {
+                diff_stack& rest = sa.empty() ? sb : sa;
+                batch_op op = sa.empty() ? batch_op::insert : batch_op::erase;
+                if (!rest.top().second) {
+                    expand(rest);
+                    continue;
+                }
+                emit(rest.top().first->key(), op);
+                rest.pop();
+                continue;
+            }
+            std::pair<node const*, bool> ta = sa.top(), tb = sb.top();
+            if (!ta.second && !tb.second && ta.first == tb.first) {
+                sa.pop();
+                sb.pop();
+            } else if (!ta.second && (tb.second || ta.first->size >= tb.first->size)) {
+                expand(sa);
+            } else if (!tb.second) {
+                expand(sb);
+            } else if (less(ta.first->key(), tb.first->key())) {
+                emit(ta.first->key(), batch_op::erase);
+                sa.pop();
+            } else if (less(tb.first->key(), ta.first->key())) {
+                emit(tb.first->key(), batch_op::insert);
+                sb.pop();
+            } else {
+                sa.pop();
+                sb.pop();
+            }
         }
+    }
 
-        return new_cur;
+    template <bool upper, typename It = iterator, typename K>
+    It bound(K const& k) const {
+        It it(root);
+        it.template seek_bound<upper>(k);
+        return it;
     }
 
-    static scoped_ptr<node> getMin(scoped_ptr<node> cur) noexcept {
-        if (!cur) return nullptr;
-        if (cur->left == nullptr)
-            return cur;
-        else
-            return getMin(cur->left);
+    template <typename It, typename K>
+    It seek(K const& k) const {
+        It it(root);
+        it.seek(k);
+        return it;
     }
 
-    static scoped_ptr<node> getMax(scoped_ptr<node> cur) noexcept {
-        if (!cur) return nullptr;
-        if (cur->right == nullptr)
-            return cur;
-        else
-            return getMax(cur->right);
+    template <typename It>
+    It leftmost() const {
+        It it(root);
+        it.descend_left(raw(root));
+        return it;
     }
 
-    static scoped_ptr<node> delMin(scoped_ptr<node> cur) {
-        if (!cur) return nullptr;
-        if (cur->left == nullptr)
-            return cur->right ? scoped_ptr<node>(new node(cur->right->key, cur->right->left, cur->right->right)) : nullptr;
-        scoped_ptr<node> new_cur = scoped_ptr<node>(new node(cur->key, cur->left, cur->right));
-        new_cur->left = delMin(cur->left);
-        return new_cur;
+    template <typename K>
+    range_view range_of(K const& lo, K const& hi) const {
+        if (less(hi, lo)) return {end(), end()};
+        return {bound<false>(lo), bound<false>(hi)};
     }
 
-    static scoped_ptr<node> del(scoped_ptr<node> cur, T k) {
-        if (cur == nullptr) return nullptr;
+    static aggregate_type aggregate_of(scoped_ptr<node> const& p) {
+        return p ? p->aggregate() : augmentation::identity();
+    }
 
-        scoped_ptr<node> new_cur = scoped_ptr<node>(new node(cur->key, cur->left, cur->right));
+    // Finds the top node inside [lo, hi), then folds in what lies inside
+    // the range on each side of it: going down its left subtree, a node
+    // not below lo brings itself and its whole right subtree along; going
+    // down the right subtree, a node below hi brings itself and its left
+    // subtree. The order of the keys is kept for non-commutative policies.
+    template <typename K>
+    aggregate_type aggregate_between(K const& lo, K const& hi) const {
+        node const* top = raw(root);
+        while (top) {
+            if (less(top->key(), lo))
+                top = raw(top->right);
+            else if (!less(top->key(), hi))
+                top = raw(top->left);
+            else break;
+        }
+        if (!top) return augmentation::identity();
 
-        if (k < cur->key) {
-            new_cur->left = del(cur->left, k);
-        } else if (k > cur->key) {
-            new_cur->right = del(cur->right, k);
-        } else {
-            if (cur->right == nullptr) {
-                if (!cur->left) return nullptr;
-                return scoped_ptr<node>(new node(cur->left->key, cur->left->left, cur->left->right));
+        aggregate_type low = augmentation::identity();
+        for (node const* cur = raw(top->left); cur; ) {
+            if (less(cur->key(), lo)) {
+                cur = raw(cur->right);
+            } else {
+                low = augmentation::combine(
+                    augmentation::combine(augmentation::of(cur->key()), aggregate_of(cur->right)), low);
+                cur = raw(cur->left);
             }
-            if (cur->left == nullptr) {
-                if (!cur->right) return nullptr;
-                return scoped_ptr<node>(new node(cur->right->key, cur->right->left, cur->right->right));
+        }
+        aggregate_type high = augmentation::identity();
+        for (node const* cur = raw(top->right); cur; ) {
+            if (less(cur->key(), hi)) {
+                high = augmentation::combine(
+                    high, augmentation::combine(aggregate_of(cur->left), augmentation::of(cur->key())));
+                cur = raw(cur->right);
+            } else {
+                cur = raw(cur->left);
             }
-            scoped_ptr<node> tmp = scoped_ptr<node>(new node(cur->key, cur->left, cur->right));
-            scoped_ptr<node> ttmp = getMin(cur->right);
+        }
+        return augmentation::combine(augmentation::combine(low, augmentation::of(top->key())), high);
+    }
 
-            new_cur = scoped_ptr<node>(new node(ttmp->key, ttmp->left, ttmp->right));
+    // In-order walk from the first key not below *lo (if given) up to the
+    // first key not below *hi (if given). The stack holds the nodes whose
+    // key is still to come, each above its left subtree's remainder.
+    template <typename K, typename F>
+    void walk(K const* lo, K const* hi, F& f) const {
+        small_stack<node const*, inline_depth> pending;
+        for (node const* cur = raw(root); cur; ) {
+            if (lo && less(cur->key(), *lo)) {
+                cur = raw(cur->right);
+            } else {
+                pending.push(cur);
+                cur = raw(cur->left);
+            }
+        }
+        while (!pending.empty()) {
+            node const* n = pending.top();
+            pending.pop();
+            if (hi && !less(n->key(), *hi)) return;
+            f(n->key());
+            for (node const* cur = raw(n->right); cur; cur = raw(cur->left)) pending.push(cur);
+        }
+    }
 
-            new_cur->right  = delMin(tmp->right);
-            new_cur->left = tmp->left;
+    template <typename K>
+    std::size_t rank_of(K const& k) const {
+        std::size_t r = 0;
+        node const* cur = raw(root);
+        while (cur) {
+            if (less(cur->key(), k)) {
+                r += editor::size(cur->left) + 1;
+                cur = raw(cur->right);
+            } else {
+                cur = raw(cur->left);
+            }
         }
+        return r;
+    }
 
-        return new_cur;
+    template <typename K>
+    std::size_t count_between(K const& lo, K const& hi) const {
+        std::size_t a = rank_of(lo), b = rank_of(hi);
+        return b > a ? b - a : 0;
     }
 
-    static scoped_ptr<node> prev(scoped_ptr<node> cur, T k) {
-        if (cur == nullptr) return nullptr;
-        std::vector<scoped_ptr<node>> path;
-        path.push_back(nullptr);
-        while (cur && cur->key != k) {
-            path.push_back(cur);
-            if (cur->key > k) {
-                cur = cur->left;
-            } else if (cur->key < k) {
-                cur = cur->right;
+    // Links on the way down from the root, each with the side taken below
+    // it. The old version stays alive while an edit runs, so plain pointers
+    // to its links are enough.
+    using edit_path = small_stack<std::pair<scoped_ptr<node> const*, bool>, inline_depth>;
+
+    template <typename K>
+    static scoped_ptr<node> put(editor& ed, scoped_ptr<node> const& top, K&& k) {
+        edit_path path;
+        scoped_ptr<node> const* cur = &top;
+        while (*cur) {
+            node const* n = raw(*cur);
+            if (less(k, n->key())) {
+                path.push({cur, true});
+                cur = &n->left;
+            } else if (less(n->key(), k)) {
+                path.push({cur, false});
+                cur = &n->right;
+            } else {
+                // Key already present: leave the path shared instead of copying it.
+                ed.tracked = n;
+                return top;
             }
         }
-        assert(cur != nullptr);
-        if (cur->left) return getMax(cur->left);
-        while (!path.empty()) {
-            if (path.back()->right == cur) return path.back();
-            cur = path.back();
-            path.pop_back();
+
+        scoped_ptr<node> leaf = ed.leaf(std::forward<K>(k));
+        ed.changed = true;
+        ed.tracked = raw(leaf);
+        try {
+            claim_path(ed, path);
+            return rebuild_path(ed, path, std::move(leaf));
+        } catch (...) {
+            ed.rollback();
+            throw;
         }
-        return nullptr;
     }
 
-    static scoped_ptr<node> next(scoped_ptr<node> cur, T k) {
-        if (cur == nullptr) return nullptr;
-        std::vector<scoped_ptr<node>> path;
-        path.push_back(nullptr);
-        while (cur && cur->key != k) {
-            path.push_back(cur);
-            if (cur->key > k) {
-                cur = cur->left;
-            } else if (cur->key < k) {
-                cur = cur->right;
+    template <typename K>
+    static scoped_ptr<node> del(editor& ed, scoped_ptr<node> const& top, K const& k) {
+        edit_path path;
+        scoped_ptr<node> const* cur = &top;
+        while (*cur) {
+            node const* n = raw(*cur);
+            if (less(k, n->key())) {
+                path.push({cur, true});
+                cur = &n->left;
+            } else if (less(n->key(), k)) {
+                path.push({cur, false});
+                cur = &n->right;
+            } else {
+                ed.changed = true;
+                try {
+                    if (claim_path(ed, path)) ed.claim(*cur);
+                    scoped_ptr<node> sub = balancer::merge(ed, ed.left(*cur), ed.right(*cur));
+                    return rebuild_path(ed, path, std::move(sub));
+                } catch (...) {
+                    ed.rollback();
+                    throw;
+                }
             }
         }
-        assert(cur != nullptr);
-        if (cur->right) return getMin(cur->right);
+        return top;
+    }
+
+    // Claims the recorded path from the root down for as long as every link
+    // on it has a single owner. Returns whether the whole path was claimed.
+    static bool claim_path(editor& ed, edit_path& path) {
+        for (std::size_t i = 0; i < path.size(); ++i) {
+            if (!ed.claim(*path[i].first)) return false;
+        }
+        return true;
+    }
+
+    // Copies the recorded path bottom-up over the new subtree sub.
+    static scoped_ptr<node> rebuild_path(editor& ed, edit_path& path, scoped_ptr<node> sub) {
         while (!path.empty()) {
-            if (path.back()->left == cur) return path.back();
-            cur = path.back();
-            path.pop_back();
+            scoped_ptr<node> const& cur = *path.top().first;
+            bool went_left = path.top().second;
+            path.pop();
+            scoped_ptr<node> l = went_left ? std::move(sub) : ed.left(cur);
+            scoped_ptr<node> r = went_left ? ed.right(cur) : std::move(sub);
+            sub = balancer::balance(ed, cur, std::move(l), std::move(r));
         }
-        return nullptr;
+        return sub;
     }
 };
 
-template <typename T, template<typename> class scoped_ptr>
-struct persistent_set<T, scoped_ptr>::iterator
+// Single-owner builder over a persistent_set, like Clojure's transients.
+// Nodes the transient creates or finds unshared carry its edit token and
+// are changed in place by later edits instead of being copied; nodes still
+// shared with the version it started from are copied once, on first touch.
+// persistent() hands out the tree in O(1) and gives the transient a fresh
+// token, so nodes of the frozen version are never changed again.
+//
+// A transient is not a snapshot: it has no iterators, and it must not be
+// shared between threads.
+template <typename T, template<typename> class scoped_ptr, typename balancer, typename allocator,
+          typename Compare, typename augmentation>
+struct persistent_set<T, scoped_ptr, balancer, allocator, Compare, augmentation>::transient_set
 {
+    transient_set() : token(next_token()) {}
+
+    explicit transient_set(persistent_set const& from)
+        : tree(from), token(next_token()) {}
+
+    transient_set(transient_set const&) = delete;
+    transient_set& operator=(transient_set const&) = delete;
+
+    transient_set(transient_set&& other) noexcept
+        : tree(std::move(other.tree)), token(other.token) {
+        other.token = next_token();
+    }
+
+    transient_set& operator=(transient_set&& other) noexcept {
+        tree = std::move(other.tree);
+        token = other.token;
+        other.token = next_token();
+        return *this;
+    }
+
+    bool insert(value_type const& value) {
+        editor ed(token);
+        tree.root = put(ed, tree.root, value);
+        return ed.changed;
+    }
+
+    bool insert(value_type&& value) {
+        editor ed(token);
+        tree.root = put(ed, tree.root, std::move(value));
+        return ed.changed;
+    }
+
+    std::size_t erase(value_type const& value) {
+        editor ed(token);
+        tree.root = del(ed, tree.root, value);
+        return ed.changed ? 1 : 0;
+    }
+
+    bool contains(value_type const& value) const {
+        return tree.contains(value);
+    }
+
+    std::size_t size() const noexcept {
+        return tree.size();
+    }
+
+    // Freezes the current contents. The transient is left empty.
+    persistent_set persistent() {
+        token = next_token();
+        return std::move(tree);
+    }
+
+private:
+
+    persistent_set tree;
+    std::uint64_t token;
+};
+
+template <typename T, template<typename> class scoped_ptr, typename balancer, typename allocator,
+          typename Compare, typename augmentation>
+struct persistent_set<T, scoped_ptr, balancer, allocator, Compare, augmentation>::range_view
+{
+    iterator first;
+    iterator last;
+
+    iterator begin() const {
+        return first;
+    }
+
+    iterator end() const {
+        return last;
+    }
+
+    bool empty() const {
+        return first == last;
+    }
+};
+
+// The iterator lookups of a persistent_set, with iterators that point at
+// the set's root instead of holding a reference to it. Every iterator of
+// the set itself bumps the reference count of the root when it is made,
+// copied or dropped, and readers of one version on many cores then fight
+// over that line; these write nothing. They are valid only while the set
+// they came from is alive and unchanged.
+template <typename T, template<typename> class scoped_ptr, typename balancer, typename allocator,
+          typename Compare, typename augmentation>
+struct persistent_set<T, scoped_ptr, balancer, allocator, Compare, augmentation>::borrowed_view
+{
+    borrowed_iterator begin() const {
+        return set.template leftmost<borrowed_iterator>();
+    }
+
+    borrowed_iterator end() const {
+        return borrowed_iterator(set.root);
+    }
+
+    borrowed_iterator find(value_type const& value) const {
+        return set.template seek<borrowed_iterator>(value);
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    borrowed_iterator find(K const& key) const {
+        return set.template seek<borrowed_iterator>(key);
+    }
+
+    // First key not less than value.
+    borrowed_iterator lower_bound(value_type const& value) const {
+        return set.template bound<false, borrowed_iterator>(value);
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    borrowed_iterator lower_bound(K const& key) const {
+        return set.template bound<false, borrowed_iterator>(key);
+    }
+
+    // First key greater than value.
+    borrowed_iterator upper_bound(value_type const& value) const {
+        return set.template bound<true, borrowed_iterator>(value);
+    }
+
+    template <typename K, typename C = Compare, typename = typename C::is_transparent>
+    borrowed_iterator upper_bound(K const& key) const {
+        return set.template bound<true, borrowed_iterator>(key);
+    }
+
+private:
+
+    friend struct persistent_set;
+
+    explicit borrowed_view(persistent_set const& set) noexcept
+        : set(set) {}
+
+    persistent_set const& set;
+};
+
+// An iterator holds the root of its version - a borrowed one only points
+// at it - and the path from there down to its node.
+template <typename T, template<typename> class scoped_ptr, typename balancer, typename allocator,
+          typename Compare, typename augmentation>
+template <bool borrowed>
+struct persistent_set<T, scoped_ptr, balancer, allocator, Compare, augmentation>::basic_iterator
+{
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T const*;
+    using reference = T const&;
 
     value_type const& operator*() const {
-        return ptr->key;
+        return path.top()->key();
     }
 
-    iterator& operator++() {
-        if (getMax(owner) == ptr)
-            ptr = nullptr;
-        else
-            ptr = next(owner, ptr->key);
+    value_type const* operator->() const {
+        return &path.top()->key();
+    }
+
+    basic_iterator& operator++() {
+        attach();
+        node const* cur = path.top();
+        if (cur->right) {
+            descend_left(raw(cur->right));
+            return *this;
+        }
+        path.pop();
+        while (!path.empty() && raw(path.top()->right) == cur) {
+            cur = path.top();
+            path.pop();
+        }
         return *this;
     }
 
-    iterator operator++(int) {
-        iterator i = *this;
+    basic_iterator operator++(int) {
+        basic_iterator i = *this;
         ++(*this);
         return i;
     }
 
-    iterator& operator--() {
-        if (ptr == nullptr) ptr = getMax(owner);
-        else ptr = prev(owner, ptr->key);
+    basic_iterator& operator--() {
+        attach();
+        if (path.empty()) {
+            descend_right(raw(owner));
+            return *this;
+        }
+        node const* cur = path.top();
+        if (cur->left) {
+            descend_right(raw(cur->left));
+            return *this;
+        }
+        path.pop();
+        while (!path.empty() && raw(path.top()->left) == cur) {
+            cur = path.top();
+            path.pop();
+        }
         return *this;
     }
 
-    iterator operator--(int) {
-        iterator i = *this;
+    basic_iterator operator--(int) {
+        basic_iterator i = *this;
         --(*this);
         return i;
     }
 
-    iterator(iterator const& other) : ptr{other.ptr}, owner{other.owner} {}
+    friend bool operator ==(basic_iterator const& a, basic_iterator const& b) noexcept {
+        return (a.owner == b.owner && a.current() == b.current());
+    }
+
+    friend bool operator !=(basic_iterator const& a, basic_iterator const& b) noexcept {
+        return !(a == b);
+    }
+
+private:
+
+    friend struct persistent_set;
+    friend struct borrowed_view;
+
+    using root_link = typename std::conditional<borrowed, node const*, scoped_ptr<node>>::type;
 
-    iterator(scoped_ptr<node>const & owner, scoped_ptr<node> const& ptr) noexcept
-        : ptr(ptr), owner(owner) {
+    explicit basic_iterator(scoped_ptr<node> const& root) noexcept
+        : owner(hold(root, std::integral_constant<bool, borrowed>())) {}
+
+    // Points at a node without knowing its ancestors yet; they are looked up
+    // only if the iterator is moved.
+    basic_iterator(scoped_ptr<node> const& root, node const* at)
+        : basic_iterator(root) {
+        if (!at) return;
+        path.push(at);
+        detached = true;
     }
 
-    iterator(scoped_ptr<node>&& owner, scoped_ptr<node>&& ptr) noexcept
-        : ptr(ptr), owner(owner) {
+    void attach() {
+        if (!detached) return;
+        node const* at = path.top();
+        path.clear();
+        detached = false;
+        seek(at->key());
     }
 
-    friend bool operator ==(iterator const& a, iterator const& b) noexcept {
-        return (a.owner == b.owner && a.ptr == b.ptr);
+    node const* current() const noexcept {
+        return path.empty() ? nullptr : path.top();
     }
 
-    friend bool operator !=(iterator const& a, iterator const& b) noexcept {
-        return !(a == b);
+    static scoped_ptr<node> const& hold(scoped_ptr<node> const& root, std::false_type) noexcept {
+        return root;
     }
 
-    ~iterator() {}
+    static node const* hold(scoped_ptr<node> const& root, std::true_type) noexcept {
+        return raw(root);
+    }
 
-private:
+    void descend_left(node const* cur) {
+        for (; cur; cur = raw(cur->left)) path.push(cur);
+    }
+
+    void descend_right(node const* cur) {
+        for (; cur; cur = raw(cur->right)) path.push(cur);
+    }
+
+    // Leaves the path at the first node past k: the first key not less than
+    // k, or with upper set, the first key greater than k. The path ends up
+    // empty (end()) when there is none.
+    template <bool upper, typename K>
+    void seek_bound(K const& k) {
+        std::size_t depth = 0;
+        node const* cur = raw(owner);
+        while (cur) {
+            path.push(cur);
+            bool before = upper ? !less(k, cur->key()) : less(cur->key(), k);
+            if (before) {
+                cur = raw(cur->right);
+            } else {
+                depth = path.size();
+                cur = raw(cur->left);
+            }
+        }
+        while (path.size() > depth) path.pop();
+    }
+
+    template <typename K>
+    void seek(K const& k) {
+        node const* cur = raw(owner);
+        while (cur) {
+            path.push(cur);
+            if (less(k, cur->key()))
+                cur = raw(cur->left);
+            else if (less(cur->key(), k))
+                cur = raw(cur->right);
+            else return;
+        }
+        path.clear();
+    }
 
-    scoped_ptr<node> ptr;
-    scoped_ptr<node> owner;
+    // owner keeps the whole version alive, or is borrowed from a set that
+    // does, so the path can hold plain pointers: stepping the iterator
+    // writes no reference counts.
+    root_link owner;
+    small_stack<node const*, inline_depth> path;
+    bool detached {false};
 };
 
 #endif // PERSISTENT_SET_H
@@ -0,0 +1,379 @@
+#ifndef PERSISTENT_SET_SNAPSHOT_H
+#define PERSISTENT_SET_SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "persistent_set.h"
+
+// Binary snapshots of ordered sets with trivially copyable keys (POSIX).
+//
+// A snapshot is a fixed 64-byte header followed by the keys in increasing
+// order, nothing else. The sorted array is itself the layout of a perfectly
+// balanced tree - the middle key is the root, the middles of the two halves
+// are its children - so it holds no pointers and reads the same wherever
+// it is mapped. snapshot_view serves lookups from a read-only mapping of
+// the file without decoding anything; snapshot_set adds edits, building
+// heap nodes from the array in O(n) on the first one.
+//
+// Keys are stored in the byte order and layout of the machine that saved
+// them; the header records enough to refuse a file from a different one.
+
+struct snapshot_header
+{
+    static constexpr std::uint32_t current_version = 1;
+    static constexpr std::uint32_t byte_order_mark = 0x01020304;
+
+    // Keys start here. The mapping is page aligned, so the keys are aligned
+    // for any key type with alignof(T) <= keys_offset; save_snapshot and
+    // snapshot_view refuse wider alignments.
+    static constexpr std::size_t keys_offset = 64;
+
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint32_t key_size;
+    std::uint32_t key_align;
+    std::uint64_t count;
+
+    template <typename T>
+    static snapshot_header describe(std::uint64_t count) noexcept {
+        snapshot_header h;
+        std::memcpy(h.magic, expected_magic(), sizeof(h.magic));
+        h.version = current_version;
+        h.byte_order = byte_order_mark;
+        h.key_size = sizeof(T);
+        h.key_align = alignof(T);
+        h.count = count;
+        return h;
+    }
+
+    // Whether a snapshot of bytes bytes with this header holds keys of type T.
+    template <typename T>
+    bool fits(std::size_t bytes) const noexcept {
+        return std::memcmp(magic, expected_magic(), sizeof(magic)) == 0
+            && version == current_version && byte_order == byte_order_mark
+            && key_size == sizeof(T) && key_align == alignof(T)
+            && bytes >= keys_offset && (bytes - keys_offset) / sizeof(T) == count
+            && (bytes - keys_offset) % sizeof(T) == 0;
+    }
+
+    static char const* expected_magic() noexcept {
+        return "PSETSNAP";
+    }
+};
+
+// A whole file mapped read-only; unmapped when the owner goes away.
+struct mapped_file
+{
+    mapped_file() = default;
+
+    explicit mapped_file(std::string const& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw std::runtime_error("mapped_file: cannot open " + path);
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("mapped_file: cannot stat " + path);
+        }
+        bytes = static_cast<std::size_t>(st.st_size);
+        if (bytes == 0) {
+            ::close(fd);
+            return;
+        }
+        void* p = ::mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) throw std::runtime_error("mapped_file: cannot map " + path);
+        base = p;
+    }
+
+    mapped_file(mapped_file const&) = delete;
+    mapped_file& operator=(mapped_file const&) = delete;
+
+    mapped_file(mapped_file&& other) noexcept
+        : base(other.base), bytes(other.bytes) {
+        other.base = nullptr;
+        other.bytes = 0;
+    }
+
+    mapped_file& operator=(mapped_file&& other) noexcept {
+        std::swap(base, other.base);
+        std::swap(bytes, other.bytes);
+        return *this;
+    }
+
+    ~mapped_file() noexcept {
+        if (base) ::munmap(base, bytes);
+    }
+
+    unsigned char const* data() const noexcept {
+        return static_cast<unsigned char const*>(base);
+    }
+
+    std::size_t size() const noexcept {
+        return bytes;
+    }
+
+private:
+
+    void* base {nullptr};
+    std::size_t bytes {0};
+};
+
+// Makes the entries of the directory holding path durable, e.g. a file
+// just renamed into it.
+inline void sync_directory_of(std::string const& path) {
+    std::string::size_type slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("sync_directory_of: cannot open " + dir);
+    int synced = ::fsync(fd);
+    ::close(fd);
+    if (synced != 0) throw std::runtime_error("sync_directory_of: cannot sync " + dir);
+}
+
+// Writes the keys of s, an ordered set (persistent_set or
+// persistent_btree_set), to path. The snapshot is written next to path,
+// synced to disk and only then renamed over it, and the rename is synced
+// in turn: readers of path never see half a snapshot, and after a crash
+// path holds either the old snapshot or the whole new one.
+template <typename Set>
+void save_snapshot(Set const& s, std::string const& path) {
+    using T = typename Set::value_type;
+    static_assert(std::is_trivially_copyable<T>::value, "save_snapshot: keys must be trivially copyable");
+    static_assert(alignof(T) <= snapshot_header::keys_offset,
+                  "save_snapshot: key alignment must not exceed snapshot_header::keys_offset");
+
+    std::string partial = path + ".partial";
+    std::FILE* out = std::fopen(partial.c_str(), "wb");
+    if (!out) throw std::runtime_error("save_snapshot: cannot create " + partial);
+    auto fail = [&](char const* what) {
+        std::fclose(out);
+        std::remove(partial.c_str());
+        throw std::runtime_error(std::string("save_snapshot: ") + what + " " + partial);
+    };
+
+    unsigned char head[snapshot_header::keys_offset] = {};
+    snapshot_header h = snapshot_header::describe<T>(s.size());
+    std::memcpy(head, &h, sizeof(h));
+    if (std::fwrite(head, 1, sizeof(head), out) != sizeof(head)) fail("cannot write");
+
+    std::vector<T> chunk;
+    chunk.reserve(4096);
+    std::uint64_t written = 0;
+    auto flush = [&] {
+        if (chunk.empty()) return;
+        if (std::fwrite(chunk.data(), sizeof(T), chunk.size(), out) != chunk.size()) fail("cannot write");
+        written += chunk.size();
+        chunk.clear();
+    };
+    for (T const& k : s) {
+        chunk.push_back(k);
+        if (chunk.size() == chunk.capacity()) flush();
+    }
+    flush();
+    if (written != h.count) fail("size changed while writing");
+    if (std::fflush(out) != 0 || ::fsync(::fileno(out)) != 0) fail("cannot sync");
+    if (std::fclose(out) != 0) {
+        std::remove(partial.c_str());
+        throw std::runtime_error("save_snapshot: cannot write " + partial);
+    }
+    if (std::rename(partial.c_str(), path.c_str()) != 0) {
+        std::remove(partial.c_str());
+        throw std::runtime_error("save_snapshot: cannot replace " + path);
+    }
+    sync_directory_of(path);
+}
+
+// Read-only set over a mapped snapshot. Lookups binary search the key
+// array in place; nothing is copied or allocated. The file is trusted to
+// hold what save_snapshot wrote: the header is checked, the order of the
+// keys is not.
+template <typename T, typename Compare = std::less<T>>
+struct snapshot_view
+{
+    static_assert(std::is_trivially_copyable<T>::value, "snapshot_view: keys must be trivially copyable");
+    static_assert(alignof(T) <= snapshot_header::keys_offset,
+                  "snapshot_view: key alignment must not exceed snapshot_header::keys_offset");
+
+    using value_type = T;
+    using key_compare = Compare;
+    using iterator = T const*;
+
+    snapshot_view() = default;
+
+    explicit snapshot_view(std::string const& path) : file(path) {
+        snapshot_header h;
+        if (file.size() < sizeof(h)) throw std::runtime_error("snapshot_view: not a snapshot: " + path);
+        std::memcpy(&h, file.data(), sizeof(h));
+        if (!h.fits<T>(file.size())) throw std::runtime_error("snapshot_view: not a snapshot of these keys: " + path);
+        first = reinterpret_cast<T const*>(file.data() + snapshot_header::keys_offset);
+        length = static_cast<std::size_t>(h.count);
+    }
+
+    iterator begin() const noexcept {
+        return first;
+    }
+
+    iterator end() const noexcept {
+        return first + length;
+    }
+
+    std::size_t size() const noexcept {
+        return length;
+    }
+
+    bool empty() const noexcept {
+        return length == 0;
+    }
+
+    // First key not less than value.
+    iterator lower_bound(value_type const& value) const {
+        return bound<false>(value);
+    }
+
+    // First key greater than value.
+    iterator upper_bound(value_type const& value) const {
+        return bound<true>(value);
+    }
+
+    bool contains(value_type const& value) const {
+        iterator it = bound<false>(value);
+        return it != end() && !Compare()(value, *it);
+    }
+
+    std::size_t count(value_type const& value) const {
+        return contains(value) ? 1 : 0;
+    }
+
+    // Number of keys less than value.
+    std::size_t rank(value_type const& value) const {
+        return static_cast<std::size_t>(bound<false>(value) - first);
+    }
+
+    template <typename F>
+    void for_each(F f) const {
+        for (iterator it = begin(); it != end(); ++it) f(*it);
+    }
+
+private:
+
+    // Branchless binary search: the halving steps do not depend on the
+    // keys, only the final position does.
+    template <bool upper>
+    iterator bound(value_type const& k) const {
+        if (length == 0) return first;
+        T const* base = first;
+        std::size_t n = length;
+        while (n > 1) {
+            std::size_t half = n / 2;
+            bool before = upper ? !Compare()(k, base[half]) : Compare()(base[half], k);
+            base = before ? base + half : base;
+            n -= half;
+        }
+        bool before = upper ? !Compare()(k, *base) : Compare()(*base, k);
+        return base + before;
+    }
+
+    mapped_file file;
+    T const* first {nullptr};
+    std::size_t length {0};
+};
+
+// A persistent_set loaded from a snapshot. Reads are answered from the
+// mapped file until the first edit that changes something; that edit
+// builds the whole set on the heap, bottom-up from the sorted keys, and
+// releases the mapping. Edits that change nothing never promote, and
+// promote() does it up front.
+template <typename Set>
+struct snapshot_set
+{
+    using value_type = typename Set::value_type;
+    using key_compare = typename Set::key_compare;
+
+    explicit snapshot_set(std::string const& path) : view(path) {}
+
+    // Whether reads are still served by the mapped file.
+    bool mapped() const noexcept {
+        return !promoted;
+    }
+
+    std::size_t size() const noexcept {
+        return promoted ? tree.size() : view.size();
+    }
+
+    bool empty() const noexcept {
+        return size() == 0;
+    }
+
+    bool contains(value_type const& value) const {
+        return promoted ? tree.contains(value) : view.contains(value);
+    }
+
+    std::size_t count(value_type const& value) const {
+        return contains(value) ? 1 : 0;
+    }
+
+    template <typename F>
+    void for_each(F f) const {
+        if (promoted)
+            tree.for_each(f);
+        else
+            view.for_each(f);
+    }
+
+    // The first insert or erase that changes the set promotes it, and so
+    // takes O(n) rather than O(log n); see promote().
+    bool insert(value_type const& value) {
+        if (!promoted && view.contains(value)) return false;
+        promote();
+        return tree.insert(value).second;
+    }
+
+    std::size_t erase(value_type const& value) {
+        if (!promoted && !view.contains(value)) return 0;
+        promote();
+        return tree.erase(value);
+    }
+
+    // The contents as a persistent_set, promoting them if needed.
+    Set const& persistent() {
+        promote();
+        return tree;
+    }
+
+    // Builds the set on the heap and releases the mapping, unless that is
+    // done already. It reads every key and allocates every node in one go,
+    // O(n) time and memory; call it ahead of the first edit to keep that
+    // stall off a latency-sensitive path.
+    void promote() {
+        if (promoted) return;
+        tree = Set(sorted_unique, view.begin(), view.end());
+        view = snapshot_view<value_type, key_compare>();
+        promoted = true;
+    }
+
+private:
+
+    snapshot_view<value_type, key_compare> view;
+    Set tree;
+    bool promoted {false};
+};
+
+template <typename Set>
+snapshot_set<Set> load_snapshot(std::string const& path) {
+    return snapshot_set<Set>(path);
+}
+
+#endif // PERSISTENT_SET_SNAPSHOT_H
@@ -0,0 +1,40 @@
+#ifndef POINTER_TRAITS_H
+#define POINTER_TRAITS_H
+
+#include <atomic>
+#include <memory>
+
+// Per-policy hooks for the scoped_ptr template parameter of persistent_set.
+// node_base is mixed into every tree node, so intrusive policies can keep
+// their bookkeeping inside the node instead of in a separate allocation.
+// thread_safe tells whether copies of one pointer may be made and dropped
+// concurrently from several threads. unique(p) tells whether p is the only
+// owner of its object, so the object may be changed without anyone else
+// noticing.
+template <template<typename> class scoped_ptr>
+struct pointer_traits {
+    struct node_base {};
+    static constexpr bool thread_safe = false;
+
+    template <typename P>
+    static bool unique(P const& p) noexcept {
+        return p.unique();
+    }
+};
+
+template <>
+struct pointer_traits<std::shared_ptr> {
+    struct node_base {};
+    static constexpr bool thread_safe = true;
+
+    // use_count() is a relaxed load; the fence orders it before the writes
+    // the caller is about to make.
+    template <typename P>
+    static bool unique(P const& p) noexcept {
+        if (p.use_count() != 1) return false;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    }
+};
+
+#endif // POINTER_TRAITS_H
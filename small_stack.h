@@ -0,0 +1,96 @@
+#ifndef SMALL_STACK_H
+#define SMALL_STACK_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Stack that keeps its first N elements inline and only touches the heap
+// when it grows deeper than that. Meant for root-to-node paths, which stay
+// well below N in a balanced tree.
+template <typename T, std::size_t N>
+struct small_stack
+{
+    small_stack() = default;
+
+    small_stack(small_stack const& other) : spill(other.spill) {
+        for (; count < other.count && count < N; ++count) new (slot(count)) T(other[count]);
+        count = other.count;
+    }
+
+    small_stack& operator = (small_stack const& other) {
+        if (this == &other) return *this;
+        small_stack copy(other);
+        clear();
+        for (; count < copy.count && count < N; ++count) new (slot(count)) T(std::move(*copy.slot(count)));
+        spill.swap(copy.spill);
+        count = copy.count;
+        return *this;
+    }
+
+    ~small_stack() {
+        clear();
+    }
+
+    bool empty() const noexcept {
+        return count == 0;
+    }
+
+    std::size_t size() const noexcept {
+        return count;
+    }
+
+    void push(T value) {
+        if (count < N)
+            new (slot(count)) T(std::move(value));
+        else
+            spill.push_back(std::move(value));
+        ++count;
+    }
+
+    void pop() {
+        --count;
+        if (count >= N)
+            spill.pop_back();
+        else
+            slot(count)->~T();
+    }
+
+    T& top() noexcept {
+        return count <= N ? *slot(count - 1) : spill.back();
+    }
+
+    T const& top() const noexcept {
+        return (*this)[count - 1];
+    }
+
+    T const& operator [] (std::size_t i) const noexcept {
+        return i < N ? *slot(i) : spill[i - N];
+    }
+
+    void clear() {
+        spill.clear();
+        for (std::size_t i = count < N ? count : N; i > 0; --i) slot(i - 1)->~T();
+        count = 0;
+    }
+
+private:
+
+    // Inline elements are constructed on push and destroyed on pop, so an
+    // empty stack of links or strings costs nothing to make.
+    T* slot(std::size_t i) noexcept {
+        return reinterpret_cast<T*>(&inline_data[i]);
+    }
+
+    T const* slot(std::size_t i) const noexcept {
+        return reinterpret_cast<T const*>(&inline_data[i]);
+    }
+
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type inline_data[N];
+    std::vector<T> spill;
+    std::size_t count {0};
+};
+
+#endif // SMALL_STACK_H
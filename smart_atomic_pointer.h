@@ -0,0 +1,158 @@
+#ifndef SMART_ATOMIC_POINTER_H
+#define SMART_ATOMIC_POINTER_H
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include "pointer_traits.h"
+
+// smart_shared_pointer with an atomic counter: copies of one pointer may be
+// made and dropped from different threads, so versions of a persistent_set
+// can be handed between threads freely. A single pointer object still must
+// not be reassigned while another thread reads it.
+template<typename T>
+struct smart_atomic_pointer {
+
+    smart_atomic_pointer() = default;
+
+    explicit smart_atomic_pointer(T* ptr) {
+        pdata = new count_obj(ptr);
+    }
+
+    smart_atomic_pointer(smart_atomic_pointer const& other) noexcept : pdata(other.pdata) {
+        add_ref();
+    }
+
+    smart_atomic_pointer(smart_atomic_pointer&& other) noexcept
+        : pdata(other.pdata) {
+        other.pdata = nullptr;
+    }
+
+    smart_atomic_pointer(std::nullptr_t) noexcept {}
+
+    smart_atomic_pointer& operator = (smart_atomic_pointer const& other) noexcept {
+        if (pdata == other.pdata) return *this;
+        count_obj* old = pdata;
+        pdata = other.pdata;
+        add_ref();
+        release(old);
+        return *this;
+    }
+
+    smart_atomic_pointer& operator = (smart_atomic_pointer&& other) noexcept {
+        if (this == &other) return *this;
+        count_obj* old = pdata;
+        pdata = other.pdata;
+        other.pdata = nullptr;
+        release(old);
+        return *this;
+    }
+
+    smart_atomic_pointer& operator = (std::nullptr_t) noexcept {
+        count_obj* old = pdata;
+        pdata = nullptr;
+        release(old);
+        return *this;
+    }
+
+    ~smart_atomic_pointer() noexcept {
+        release(pdata);
+    }
+
+    T& operator *() const {
+        return *pdata->data;
+    }
+
+    T* operator ->() const {
+        return pdata->data;
+    }
+
+    friend void swap(smart_atomic_pointer& p1, smart_atomic_pointer& p2) noexcept {
+        std::swap(p1.pdata, p2.pdata);
+    }
+
+    void swap(smart_atomic_pointer& p2) noexcept {
+        std::swap(pdata, p2.pdata);
+    }
+
+    operator bool() const noexcept {
+        return pdata;
+    }
+
+    // Acquire pairs with the release of other owners, so once this reads 1
+    // their last accesses to the object happen before anything done next.
+    long use_count() const noexcept {
+        return pdata ? pdata->cnt_refs.load(std::memory_order_acquire) : 0;
+    }
+
+    bool unique() const noexcept {
+        return use_count() == 1;
+    }
+
+    friend bool operator == (smart_atomic_pointer const& a, smart_atomic_pointer const& b) noexcept {
+        return a.pdata == b.pdata;
+    }
+
+    friend bool operator != (smart_atomic_pointer const& a, smart_atomic_pointer const& b) noexcept {
+        return !(a == b);
+    }
+
+    friend bool operator == (smart_atomic_pointer const& a, std::nullptr_t) noexcept {
+        return !a.pdata;
+    }
+
+    friend bool operator != (smart_atomic_pointer const& a, std::nullptr_t) noexcept {
+        return a.pdata;
+    }
+
+    friend bool operator == (std::nullptr_t, smart_atomic_pointer const& a) noexcept {
+        return a == nullptr;
+    }
+
+    friend bool operator != (std::nullptr_t, smart_atomic_pointer const& a) noexcept {
+        return a != nullptr;
+    }
+
+private:
+
+    struct count_obj {
+        std::atomic<int> cnt_refs {1};
+        T* data {};
+
+        count_obj(T *data) noexcept
+            : data(data) {}
+
+        ~count_obj() noexcept {
+            delete data;
+        }
+    };
+
+    count_obj *pdata {};
+
+    // A new reference is always made from an existing one, so nothing has
+    // to be ordered against it.
+    void add_ref() const noexcept {
+        if (pdata) pdata->cnt_refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // The last owner must see every write made through the other owners
+    // before it destroys the object.
+    static void release(count_obj* p) noexcept {
+        if (p && p->cnt_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete p;
+        }
+    }
+};
+
+template <>
+struct pointer_traits<smart_atomic_pointer> {
+    struct node_base {};
+    static constexpr bool thread_safe = true;
+
+    template <typename P>
+    static bool unique(P const& p) noexcept {
+        return p.unique();
+    }
+};
+
+#endif // SMART_ATOMIC_POINTER_H
@@ -0,0 +1,152 @@
+#ifndef SMART_INTRUSIVE_POINTER_H
+#define SMART_INTRUSIVE_POINTER_H
+
+#include <cstddef>
+#include <utility>
+#include "pointer_traits.h"
+
+// Base for objects owned by smart_intrusive_pointer. The counter lives in the
+// object itself, so owning it takes one allocation and no extra pointer hop.
+struct intrusive_ref_counter {
+
+    intrusive_ref_counter() = default;
+
+    intrusive_ref_counter(intrusive_ref_counter const&) noexcept {}
+
+    intrusive_ref_counter& operator = (intrusive_ref_counter const&) noexcept {
+        return *this;
+    }
+
+    mutable int cnt_refs {};
+};
+
+template <typename T>
+struct smart_intrusive_pointer {
+
+    smart_intrusive_pointer() = default;
+
+    explicit smart_intrusive_pointer(T* ptr) noexcept : pdata(ptr) {
+        add_ref();
+    }
+
+    smart_intrusive_pointer(smart_intrusive_pointer const& other) noexcept : pdata(other.pdata) {
+        add_ref();
+    }
+
+    smart_intrusive_pointer(smart_intrusive_pointer&& other) noexcept
+        : pdata(other.pdata) {
+        other.pdata = nullptr;
+    }
+
+    smart_intrusive_pointer(std::nullptr_t) noexcept {}
+
+    smart_intrusive_pointer& operator = (smart_intrusive_pointer const& other) noexcept {
+        if (pdata == other.pdata) return *this;
+        T* old = pdata;
+        pdata = other.pdata;
+        add_ref();
+        release(old);
+        return *this;
+    }
+
+    smart_intrusive_pointer& operator = (smart_intrusive_pointer&& other) noexcept {
+        if (this == &other) return *this;
+        T* old = pdata;
+        pdata = other.pdata;
+        other.pdata = nullptr;
+        release(old);
+        return *this;
+    }
+
+    smart_intrusive_pointer& operator = (std::nullptr_t) noexcept {
+        T* old = pdata;
+        pdata = nullptr;
+        release(old);
+        return *this;
+    }
+
+    ~smart_intrusive_pointer() noexcept {
+        release(pdata);
+    }
+
+    T& operator *() const {
+        return *pdata;
+    }
+
+    T* operator ->() const {
+        return pdata;
+    }
+
+    friend void swap(smart_intrusive_pointer& p1, smart_intrusive_pointer& p2) noexcept {
+        std::swap(p1.pdata, p2.pdata);
+    }
+
+    void swap(smart_intrusive_pointer& p2) noexcept {
+        std::swap(pdata, p2.pdata);
+    }
+
+    operator bool() const noexcept {
+        return pdata;
+    }
+
+    long use_count() const noexcept {
+        return pdata ? pdata->cnt_refs : 0;
+    }
+
+    bool unique() const noexcept {
+        return use_count() == 1;
+    }
+
+    friend bool operator == (smart_intrusive_pointer const& a, smart_intrusive_pointer const& b) noexcept {
+        return a.pdata == b.pdata;
+    }
+
+    friend bool operator != (smart_intrusive_pointer const& a, smart_intrusive_pointer const& b) noexcept {
+        return !(a == b);
+    }
+
+    friend bool operator == (smart_intrusive_pointer const& a, std::nullptr_t) noexcept {
+        return !a.pdata;
+    }
+
+    friend bool operator != (smart_intrusive_pointer const& a, std::nullptr_t) noexcept {
+        return a.pdata;
+    }
+
+    friend bool operator == (std::nullptr_t, smart_intrusive_pointer const& a) noexcept {
+        return a == nullptr;
+    }
+
+    friend bool operator != (std::nullptr_t, smart_intrusive_pointer const& a) noexcept {
+        return a != nullptr;
+    }
+
+private:
+
+    T *pdata {nullptr};
+
+    void add_ref() const noexcept {
+        if (pdata) ++(pdata->cnt_refs);
+    }
+
+    // Old value is detached before release, so destroying it may safely
+    // drop the last reference to whatever this pointer was assigned from.
+    static void release(T* ptr) noexcept {
+        if (ptr && !--(ptr->cnt_refs)) {
+            delete ptr;
+        }
+    }
+};
+
+template <>
+struct pointer_traits<smart_intrusive_pointer> {
+    using node_base = intrusive_ref_counter;
+    static constexpr bool thread_safe = false;
+
+    template <typename P>
+    static bool unique(P const& p) noexcept {
+        return p.unique();
+    }
+};
+
+#endif // SMART_INTRUSIVE_POINTER_H
@@ -97,6 +97,19 @@ struct smart_linked_pointer {
         return pdata;
     }
 
+    // Walks the list of owners.
+    long use_count() const noexcept {
+        if (!pdata) return 0;
+        long n = 1;
+        for (smart_linked_pointer const* p = left; p; p = p->left) ++n;
+        for (smart_linked_pointer const* p = right; p; p = p->right) ++n;
+        return n;
+    }
+
+    bool unique() const noexcept {
+        return pdata && !left && !right;
+    }
+
     friend bool operator == (smart_linked_pointer const& a, smart_linked_pointer const& b) noexcept {
         return a.pdata == b.pdata;
     }
@@ -79,6 +79,14 @@ struct smart_shared_pointer{
         return pdata;
     }
 
+    long use_count() const noexcept {
+        return pdata ? pdata->cnt_refs : 0;
+    }
+
+    bool unique() const noexcept {
+        return use_count() == 1;
+    }
+
     friend bool operator == (smart_shared_pointer const& a, smart_shared_pointer const& b) noexcept {
         return a.pdata == b.pdata;
     }